@@ -7,13 +7,17 @@
 ////////////////////////////////////////////////////////////////////////
 
 #include <stdio.h>
+#include <cstdlib>
 #include <cstddef>
 #include <vector>
 #include <math.h>
 #include <string>
+#include <fstream>
 #include <memory>
 #include <stdexcept>
 #include <list>
+#include <algorithm>
+#include <unistd.h>
 #if __GNUG__
 #   include <tr1/memory>
 #endif
@@ -34,10 +38,21 @@
 #include "geometrymaker.h"
 #include "arcball.h"
 #include "scenegraph.h"
+#include "geometry.h"
+#include "objloader.h"
 
 #include "asstcommon.h"
+#include "frameuniforms.h"
+#include "lightclusters.h"
+#include "shaderpermutations.h"
+#include "timing.h"
+#include "frameprofiler.h"
+#include "trace.h"
 #include "drawer.h"
+#include "occlusionculler.h"
+#include "posebuffers.h"
 #include "picker.h"
+#include "raypicker.h"
 #include "sgutils.h"
 
 using namespace std;
@@ -92,121 +107,166 @@ static double g_arcballScreenRadius = 100; // number of pixels
 static double g_arcballScale = 1;
 
 static bool g_pickingMode = false;
+static bool g_rayCastPicking = true;     // pick on the CPU instead of reading the pick buffer
+static bool g_rectSelectMode = false;    // next left drag selects everything inside a rectangle
+static bool g_rectSelecting = false;     // is such a drag in progress
+static int g_rectX0, g_rectY0, g_rectX1, g_rectY1; // its corners in OpenGL window coordinates
 
 // -------- Shaders
 
-static const int g_numShaders = 3, g_numRegularShaders = 2;
-static const int PICKING_SHADER = 2;
-static const char * const g_shaderFiles[g_numShaders][2] = {
-  {"./shaders/basic-gl3.vshader", "./shaders/diffuse-gl3.fshader"},
-  {"./shaders/basic-gl3.vshader", "./shaders/solid-gl3.fshader"},
-  {"./shaders/basic-gl3.vshader", "./shaders/pick-gl3.fshader"}
-};
-static const char * const g_shaderFilesGl2[g_numShaders][2] = {
-  {"./shaders/basic-gl2.vshader", "./shaders/diffuse-gl2.fshader"},
-  {"./shaders/basic-gl2.vshader", "./shaders/solid-gl2.fshader"},
-  {"./shaders/basic-gl2.vshader", "./shaders/pick-gl2.fshader"}
-};
-static vector<shared_ptr<ShaderState> > g_shaderStates; // our global shader states
+// Every program is a permutation of one shader pair, see ShaderPermutations
+static const char * const g_shaderFiles[2] = {"./shaders/basic-gl3.vshader", "./shaders/surface-gl3.fshader"};
+static const char * const g_shaderFilesGl2[2] = {"./shaders/basic-gl2.vshader", "./shaders/surface-gl2.fshader"};
+static shared_ptr<ShaderPermutations> g_shaders;
 
-// linked list of frame vectors
-static list<vector<RigTForm> > key_frames;
-static int cur_frame = -1;
+// The shadings cycled through by g_activeShader
+static const int g_numRegularShaders = 2;
+static const unsigned g_shadingFeatures[g_numRegularShaders] = {SHADER_LIT, 0};
 
-// --------- Geometry
+// CPU and GPU times of the frames drawn by display
+static shared_ptr<FrameProfiler> g_frameProfiler;
+static const char * const g_frameProfileFile = "frameprofile.csv";
 
-// Macro used to obtain relative offset of a field within a struct
-#define FIELD_OFFSET(StructType, field) ((GLvoid*)offsetof(StructType, field))
+// Where linked programs are kept between runs
+static const char * const g_shaderCacheDir = "./shadercache";
+static shared_ptr<InstanceBuffer> g_instanceBuffer;
 
-// A vertex with floating point position and normal
-struct VertexPN {
-  Cvec3f p, n;
+// Per draw matrices of the frame, for shaders with the PerDraw block (GL3 only)
+static shared_ptr<FrameUniforms> g_frameUniforms;
 
-  VertexPN() {}
-  VertexPN(float x, float y, float z,
-           float nx, float ny, float nz)
-    : p(x,y,z), n(nx, ny, nz)
-  {}
+// Light lists of the view frustum's clusters, for the GL3 diffuse shader
+static shared_ptr<LightClusters> g_lightClusters;
 
-  // Define copy constructor and assignment operator from GenericVertex so we can
-  // use make* functions from geometrymaker.h
-  VertexPN(const GenericVertex& v) {
-    *this = v;
-  }
+// Skips the robots hidden behind others while g_occlusionCulling is on
+static shared_ptr<OcclusionCuller> g_occlusionCuller;
+static bool g_occlusionCulling = false;
 
-  VertexPN& operator = (const GenericVertex& v) {
-    p = v.pos;
-    n = v.normal;
-    return *this;
-  }
-};
-
-struct Geometry {
-  GlBufferObject vbo, ibo;
-  GlArrayObject vao;
-  int vboLen, iboLen;
+// Shapes drawn by the last frame. The next one splits its traversal among
+// threads once there are DRAW_ITEMS_PER_THREAD shapes for each
+static int g_lastDrawItems = 0;
+static const int DRAW_ITEMS_PER_THREAD = 512;
 
-  Geometry(VertexPN *vtx, unsigned short *idx, int vboLen, int iboLen) {
-    this->vboLen = vboLen;
-    this->iboLen = iboLen;
-
-    // Now create the VBO and IBO
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(VertexPN) * vboLen, vtx, GL_STATIC_DRAW);
-
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned short) * iboLen, idx, GL_STATIC_DRAW);
-  }
-
-  void draw(const ShaderState& curSS) {
-    // bind the object's VAO
-    glBindVertexArray(vao);
-
-    // Enable the attributes used by our shader
-    safe_glEnableVertexAttribArray(curSS.h_aPosition);
-    safe_glEnableVertexAttribArray(curSS.h_aNormal);
-
-    // bind vbo
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    safe_glVertexAttribPointer(curSS.h_aPosition, 3, GL_FLOAT, GL_FALSE, sizeof(VertexPN), FIELD_OFFSET(VertexPN, p));
-    safe_glVertexAttribPointer(curSS.h_aNormal, 3, GL_FLOAT, GL_FALSE, sizeof(VertexPN), FIELD_OFFSET(VertexPN, n));
-
-    // bind ibo
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+// linked list of frame vectors
+static list<vector<RigTForm> > key_frames;
+static int cur_frame = -1;
 
-    // draw!
-    glDrawElements(GL_TRIANGLES, iboLen, GL_UNSIGNED_SHORT, 0);
+// --------- Geometry
 
-    // Disable the attributes used by our shader
-    safe_glDisableVertexAttribArray(curSS.h_aPosition);
-    safe_glDisableVertexAttribArray(curSS.h_aNormal);
+typedef SgGeometryShapeNode<Geometry> MyShapeNode;
 
-    // disable VAO
-    glBindVertexArray(NULL);
-  }
-};
+// Shared vertex and index buffers all static meshes are allocated from
+static shared_ptr<GeometryArena> g_geometryArena;
 
-typedef SgGeometryShapeNode<Geometry> MyShapeNode;
+// Levels of detail of the geometry that has them (the sphere)
+static shared_ptr<LodRegistry> g_lodRegistry;
 
 // Vertex buffer and index buffer associated with the ground and cube geometry
 static shared_ptr<Geometry> g_ground, g_cube, g_sphere;
 
+// An OBJ mesh named on the command line, if any
+static const char *g_meshFile = NULL;
+static shared_ptr<Geometry> g_mesh;
+
 // --------- Scene
 
 static const Cvec3 g_light1(2.0, 3.0, 14.0), g_light2(-2, -3.0, -5.0);  // define two lights positions in world space
 
+// All lights of the GL3 shaders: the two above, then any local lights asked
+// for through CS175_POINT_LIGHTS. GL2 shaders only use the first two
+static vector<PointLight> g_pointLights;
+
 static shared_ptr<SgRootNode> g_world;
-static shared_ptr<SgRbtNode> g_skyNode, g_groundNode, g_robot1Node, g_robot2Node;
+static shared_ptr<SgRbtNode> g_skyNode, g_groundNode, g_robot1Node, g_robot2Node, g_meshNode;
 
 static shared_ptr<SgRbtNode> g_currentCameraNode;
 static shared_ptr<SgRbtNode> g_currentPickedRbtNode;
+static vector<shared_ptr<SgRbtNode> > g_selectedRbtNodes; // manipulated together; includes the picked node
+
+// Offscreen object ids, re-rendered only when what it was rendered from changes
+static shared_ptr<PickBuffer> g_pickBuffer;
+
+struct PickBufferStamp {
+  unsigned long sceneGeneration;
+  const SgRbtNode *camera;
+  int width, height;
+  float fovY;
+
+  bool operator == (const PickBufferStamp& o) const {
+    return sceneGeneration == o.sceneGeneration && camera == o.camera &&
+      width == o.width && height == o.height && fovY == o.fovY;
+  }
+};
+static PickBufferStamp g_pickBufferStamp;
+static bool g_pickBufferValid = false;
+
+// Everything a displayed frame depends on, so that input which changes none of
+// it does not cause a redisplay
+struct DisplayStamp {
+  unsigned long sceneGeneration;
+  const SgRbtNode *camera, *picked;
+  int width, height;
+  float fovY;
+  int activeShader, activeCameraFrame;
+  bool displayArcball, translating, occlusionCulling;
+  int rect[5];                               // whether selecting, and the corners
+
+  bool operator == (const DisplayStamp& o) const {
+    return sceneGeneration == o.sceneGeneration && camera == o.camera && picked == o.picked &&
+      width == o.width && height == o.height && fovY == o.fovY &&
+      activeShader == o.activeShader && activeCameraFrame == o.activeCameraFrame &&
+      displayArcball == o.displayArcball && translating == o.translating &&
+      occlusionCulling == o.occlusionCulling &&
+      equal(rect, rect + 5, o.rect);
+  }
+};
+static DisplayStamp g_displayStamp;          // of the frame on screen
+static bool g_displayStampValid = false;
+
+// Motion events arriving between two frames are accumulated here, and applied
+// as one manipulation when the next frame starts or other input arrives
+static bool g_motionPending = false;
+static int g_pendingMotionX, g_pendingMotionY; // latest position in OpenGL window coordinates
 
 static int g_msBetweenKeyFrames = 2000;
 static int g_animateFramesPerSecond = 60;
 static bool animating = false;
+static shared_ptr<PoseBuffers> g_animationPoses; // while animating
 
 ///////////////// END OF G L O B A L S //////////////////////////////////////////////////
 
+// Whether the mouse is dragging along the view direction, during which the
+// arcball keeps its size
+static bool isTranslating() {
+  return g_mouseMClickButton || (g_mouseLClickButton && g_mouseRClickButton) || (g_mouseLClickButton && !g_mouseRClickButton && g_spaceDown);
+}
+
+static DisplayStamp getDisplayStamp() {
+  DisplayStamp stamp;
+  stamp.sceneGeneration = getSceneGeneration();
+  stamp.camera = g_currentCameraNode.get();
+  stamp.picked = g_currentPickedRbtNode.get();
+  stamp.width = g_windowWidth;
+  stamp.height = g_windowHeight;
+  stamp.fovY = g_frustFovY;
+  stamp.activeShader = g_activeShader;
+  stamp.activeCameraFrame = g_activeCameraFrame;
+  stamp.displayArcball = g_displayArcball;
+  stamp.translating = isTranslating();
+  stamp.rect[0] = g_rectSelecting;
+  stamp.rect[1] = g_rectSelecting ? g_rectX0 : 0;
+  stamp.rect[2] = g_rectSelecting ? g_rectY0 : 0;
+  stamp.rect[3] = g_rectSelecting ? g_rectX1 : 0;
+  stamp.rect[4] = g_rectSelecting ? g_rectY1 : 0;
+  stamp.occlusionCulling = g_occlusionCulling;
+  return stamp;
+}
+
+// Posts a redisplay unless the frame would be the same as the one on screen
+static void requestRedisplay() {
+  if (g_motionPending || !g_displayStampValid || !(getDisplayStamp() == g_displayStamp))
+    glutPostRedisplay();
+}
+
 static void make_frame() {
   vector<shared_ptr<SgRbtNode> > graph_vector;
   dumpSgRbtNodes(g_world, graph_vector);
@@ -275,9 +335,11 @@ static void delete_frame() {
 }
 
 static void write_frame() {
+  TRACE_SCOPE("write_frame");
   list<vector<RigTForm> >::iterator it = key_frames.begin();
   FILE* output = fopen("animation.txt", "w");
-  fprintf(output, "%d 22\n", key_frames.size());
+  // every key frame holds the rbts of all the SgRbtNodes, in traversal order
+  fprintf(output, "%d %d\n", (int) key_frames.size(), key_frames.empty() ? 0 : (int) key_frames.front().size());
   while (it != key_frames.end()) {
     vector<RigTForm> frame = *it;
     for (int i = 0; i < frame.size(); ++i) {
@@ -295,6 +357,7 @@ static void write_frame() {
 }
 
 static void read_frame() {
+  TRACE_SCOPE("read_frame");
   FILE* input = fopen("animation.txt", "r");
   if (input == NULL) {
     return;
@@ -302,12 +365,18 @@ static void read_frame() {
 
   int nFrames;
   int nRbts;
-  fscanf(input, "%d %d\n", &nFrames, &nRbts);
+  vector<shared_ptr<SgRbtNode> > rbtNodes;
+  dumpSgRbtNodes(g_world, rbtNodes);
+  if (fscanf(input, "%d %d\n", &nFrames, &nRbts) != 2 || nRbts != rbtNodes.size()) {
+    cout << "animation.txt is not an animation of this scene's " << rbtNodes.size() << " nodes" << endl;
+    fclose(input);
+    return;
+  }
   key_frames.clear();
 
   for (int i = 0; i < nFrames; ++i) {
     vector<RigTForm> frame;
-    for (int j = 0; j < 22; ++j) {
+    for (int j = 0; j < nRbts; ++j) {
       Cvec3 transFact;
       Quat linFact;
       fscanf(input, "%lf %lf %lf %lf %lf %lf %lf\n",
@@ -319,8 +388,13 @@ static void read_frame() {
     }
     key_frames.push_back(frame);
   }
-  cur_frame = 0;
-  fillSgRbtNodes(g_world, key_frames.front());
+  if (key_frames.empty()) {
+    cur_frame = KF_UNDEF;
+  }
+  else {
+    cur_frame = 0;
+    fillSgRbtNodes(g_world, key_frames.front());
+  }
   fclose(input);
 
 }
@@ -375,64 +449,87 @@ Quat bezierRot(Quat c_i_neg_1, Quat c_i, Quat c_i_1, Quat c_i_2, int i, float t)
   return qpow(cond_neg(m), 1 - t + i) * qpow(cond_neg(n), t - i);
 }
 
-bool interpolateAndDisplay(float t) {
-  list<vector<RigTForm> >::iterator it = key_frames.begin();
-  advance(it, (int) t);
-
-  ++it;
-  vector<RigTForm> frame_1 = *it;
-  ++it;
-  vector<RigTForm> frame_2 = *it;
-  ++it;
-  if (it == key_frames.end()) {
-    return true;
+// The poses at time t, in units of key frames, of a Catmull-Rom spline through
+// `frames', starting at the second key frame. Returns false, leaving `frame'
+// alone, once past the second to last key frame
+static bool interpolateKeyFrames(const vector<vector<RigTForm> >& frames, float t, vector<RigTForm>& frame) {
+  TRACE_SCOPE("interpolateKeyFrames");
+  const int i = (int) t;
+  if (i + 3 >= frames.size()) {
+    return false;
   }
-  vector<RigTForm> post_frame = *it;
-  // minus operator not overloaded for iterators. sad face.
-  --it; --it; --it;
-  vector<RigTForm> pre_frame = *it;
-
+  const vector<RigTForm>& pre_frame = frames[i];
+  const vector<RigTForm>& frame_1 = frames[i + 1];
+  const vector<RigTForm>& frame_2 = frames[i + 2];
+  const vector<RigTForm>& post_frame = frames[i + 3];
 
   // d ci ci+1 e
-  float alpha = t - (int) t;
-  vector<RigTForm> frame;
-  for (int i = 0; i < 22; ++i) {
-    Cvec3 c_i_neg_1 = pre_frame[i].getTranslation();
-    Cvec3 c_i = frame_1[i].getTranslation();
-    Cvec3 c_i_1 = frame_2[i].getTranslation();
-    Cvec3 c_i_2 = post_frame[i].getTranslation();
-
-    Quat c_i_neg_1_r = pre_frame[i].getRotation();
-    Quat c_i_r = frame_1[i].getRotation();
-    Quat c_i_1_r = frame_2[i].getRotation();
-    Quat c_i_2_r = post_frame[i].getRotation();
-
-    Cvec3 trans = bezierTrans(c_i_neg_1, c_i, c_i_1, c_i_2, (int) t, t);
-    Quat rot = bezierRot(c_i_neg_1_r, c_i_r, c_i_1_r, c_i_2_r, (int) t, t);
+  frame.clear();
+  for (int j = 0; j < frame_1.size(); ++j) {
+    Cvec3 c_i_neg_1 = pre_frame[j].getTranslation();
+    Cvec3 c_i = frame_1[j].getTranslation();
+    Cvec3 c_i_1 = frame_2[j].getTranslation();
+    Cvec3 c_i_2 = post_frame[j].getTranslation();
+
+    Quat c_i_neg_1_r = pre_frame[j].getRotation();
+    Quat c_i_r = frame_1[j].getRotation();
+    Quat c_i_1_r = frame_2[j].getRotation();
+    Quat c_i_2_r = post_frame[j].getRotation();
+
+    Cvec3 trans = bezierTrans(c_i_neg_1, c_i, c_i_1, c_i_2, i, t);
+    Quat rot = bezierRot(c_i_neg_1_r, c_i_r, c_i_1_r, c_i_2_r, i, t);
     frame.push_back(RigTForm(trans, rot));
   }
-  fillSgRbtNodes(g_world, frame);
-  glutPostRedisplay();
+  return true;
+}
 
-  return false;
+namespace {
+// Plays the key frames at the current speed, on the pose update thread. They
+// are copied, so editing them meanwhile does no harm
+class KeyFrameSource : public PoseSource {
+  vector<vector<RigTForm> > frames_;
+  int msPerFrame_, msBetweenKeyFrames_;
+
+public:
+  KeyFrameSource()
+    : frames_(key_frames.begin(), key_frames.end())
+    , msPerFrame_(1000/g_animateFramesPerSecond)
+    , msBetweenKeyFrames_(g_msBetweenKeyFrames) {}
+
+  virtual bool evaluate(int frame, vector<RigTForm>& poses) {
+    return interpolateKeyFrames(frames_, (float) (frame * msPerFrame_) / (float) msBetweenKeyFrames_, poses);
+  }
+};
 }
 
-static void animateTimerCallback(int ms) {
-  float t = (float) ms / (float) g_msBetweenKeyFrames;
+// Swaps in the poses evaluated since the last frame, and stops at the end
+static void animateTimerCallback(int) {
+  TRACE_SCOPE("animateTimerCallback");
+  if (!g_animationPoses)
+    return;
 
-  bool endReached = interpolateAndDisplay(t);
-  if (!endReached) {
-    glutTimerFunc(1000/g_animateFramesPerSecond,
-        animateTimerCallback,
-        ms + 1000/g_animateFramesPerSecond);
+  if (g_animationPoses->swap())
+    requestRedisplay();
+  if (!g_animationPoses->finished()) {
+    glutTimerFunc(1000/g_animateFramesPerSecond, animateTimerCallback, 0);
   }
   else {
+    g_animationPoses.reset();
     animating = false;
     cur_frame = key_frames.size() - 2;
-    glutPostRedisplay();
+    requestRedisplay();
   }
 }
 
+// The update thread evaluates each frame while the one before is drawn
+static void startAnimation() {
+  vector<shared_ptr<SgRbtNode> > nodes;
+  dumpSgRbtNodes(g_world, nodes);
+  g_animationPoses.reset(new PoseBuffers(nodes, shared_ptr<PoseSource>(new KeyFrameSource())));
+  animating = true;
+  animateTimerCallback(0);
+}
+
 static void initGround() {
   // A x-z plane at y = g_groundY of dimension [-g_groundSize, g_groundSize]^2
   VertexPN vtx[4] = {
@@ -442,7 +539,7 @@ static void initGround() {
     VertexPN( g_groundSize, g_groundY, -g_groundSize, 0, 1, 0)
   };
   unsigned short idx[] = {0, 1, 2, 0, 2, 3};
-  g_ground.reset(new Geometry(&vtx[0], &idx[0], 4, 6));
+  g_ground.reset(new Geometry(*g_geometryArena, &vtx[0], &idx[0], 4, 6));
 }
 
 static void initCubes() {
@@ -455,18 +552,43 @@ static void initCubes() {
   vector<unsigned short> idx(ibLen);
 
   makeCube(1, vtx.begin(), idx.begin());
-  g_cube.reset(new Geometry(&vtx[0], &idx[0], vbLen, ibLen));
+  g_cube.reset(new Geometry(*g_geometryArena, &vtx[0], &idx[0], vbLen, ibLen));
 }
 
-static void initSphere() {
+static shared_ptr<Geometry> makeSphereGeometry(int slices, int stacks) {
   int ibLen, vbLen;
-  getSphereVbIbLen(20, 10, vbLen, ibLen);
+  getSphereVbIbLen(slices, stacks, vbLen, ibLen);
 
   // Temporary storage for sphere geometry
   vector<VertexPN> vtx(vbLen);
   vector<unsigned short> idx(ibLen);
-  makeSphere(1, 20, 10, vtx.begin(), idx.begin());
-  g_sphere.reset(new Geometry(&vtx[0], &idx[0], vtx.size(), idx.size()));
+  makeSphere(1, slices, stacks, vtx.begin(), idx.begin());
+  shared_ptr<Geometry> sphere(new Geometry(*g_geometryArena, &vtx[0], &idx[0], vtx.size(), idx.size()));
+  sphere->bound.kind = ShapeBound::ELLIPSOID;
+  return sphere;
+}
+
+static void initSphere() {
+  // Tessellations from what close-ups need down to what a sphere covering a
+  // few pixels needs, with the screen radius each one is good down to
+  static const struct {
+    int slices, stacks;
+    double minRadiusPixels;
+  } levels[] = {
+    {48, 24, 150},
+    {20, 10, 40},
+    {12, 6, 12},
+    {6, 4, 0}
+  };
+
+  shared_ptr<LodChain> chain(new LodChain());
+  for (int i = 0; i < sizeof(levels) / sizeof(levels[0]); ++i) {
+    shared_ptr<Geometry> level = makeSphereGeometry(levels[i].slices, levels[i].stacks);
+    chain->addLevel(level, levels[i].minRadiusPixels);
+    if (i == 0)
+      g_sphere = level; // shapes use the finest level, and reach the others through it
+  }
+  g_lodRegistry->add(chain);
 }
 
 static void initRobots() {
@@ -552,128 +674,310 @@ static ManipMode getManipMode() {
     return ARCBALL_ON_PICKED;
 }
 
-static bool shouldUseArcball() {
-  return getManipMode() != EGO_MOTION;
-}
+// The view dependent state shared by drawing and manipulation, computed once
+// per frame or per batch of input with a single scene traversal
+struct ViewContext {
+  ManipMode manipMode;
+  RigTForm eyeRbt, invEyeRbt;
+  Matrix4 projection;
+  RigTForm arcballRbt;         // the arcball frame in world coordinates
+  RigTForm arcballEye;         // and in eye coordinates
+  Cvec3 eyeLight1, eyeLight2;
+};
+
+static ViewContext makeViewContext() {
+  ViewContext view;
+  view.manipMode = getManipMode();
 
-// The translation part of the aux frame either comes from the current
-// active object, or is the identity matrix when
-static RigTForm getArcballRbt() {
-  switch (getManipMode()) {
+  vector<shared_ptr<SgTransformNode> > nodes(1, g_currentCameraNode);
+  if (view.manipMode == ARCBALL_ON_PICKED)
+    nodes.push_back(g_currentPickedRbtNode);
+  vector<RigTForm> rbts;
+  getPathAccumRbts(g_world, nodes, rbts);
+
+  view.eyeRbt = rbts[0];
+  view.invEyeRbt = inv(view.eyeRbt);
+  view.projection = makeProjectionMatrix();
+
+  // The translation part of the aux frame either comes from the current
+  // active object, or is the identity matrix when
+  switch (view.manipMode) {
   case ARCBALL_ON_PICKED:
-    return getPathAccumRbt(g_world, g_currentPickedRbtNode);
+    view.arcballRbt = rbts[1];
+    break;
   case ARCBALL_ON_SKY:
-    return RigTForm();
+    view.arcballRbt = RigTForm();
+    break;
   case EGO_MOTION:
-    return getPathAccumRbt(g_world, g_currentCameraNode);
-  default:
-    throw runtime_error("Invalid ManipMode");
+    view.arcballRbt = view.eyeRbt;
+    break;
   }
+  view.arcballEye = view.invEyeRbt * view.arcballRbt;
+
+  view.eyeLight1 = Cvec3(view.invEyeRbt * Cvec4(g_light1, 1));
+  view.eyeLight2 = Cvec3(view.invEyeRbt * Cvec4(g_light2, 1));
+  return view;
 }
 
-static void updateArcballScale() {
-  RigTForm arcballEye = inv(getPathAccumRbt(g_world, g_currentCameraNode)) * getArcballRbt();
-  double depth = arcballEye.getTranslation()[2];
+static void updateArcballScale(const ViewContext& view) {
+  double depth = view.arcballEye.getTranslation()[2];
   if (depth > -CS175_EPS)
     g_arcballScale = 0.02;
   else
     g_arcballScale = getScreenToEyeScale(depth, g_frustFovY, g_windowHeight);
 }
 
-static void drawArcBall(const ShaderState& curSS) {
+// The features of the program drawing regular shapes in the current shading
+static unsigned getDrawFeatures() {
+  return g_shadingFeatures[g_activeShader] | (g_frameUniforms ? SHADER_PER_DRAW : 0);
+}
+
+static void drawArcBall(const ShaderState& curSS, const ViewContext& view) {
   // switch to wire frame mode
   glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
-  RigTForm arcballEye = inv(getPathAccumRbt(g_world, g_currentCameraNode)) * getArcballRbt();
-  Matrix4 MVM = rigTFormToMatrix(arcballEye) * Matrix4::makeScale(Cvec3(1, 1, 1) * g_arcballScale * g_arcballScreenRadius);
-  sendModelViewNormalMatrix(curSS, MVM, normalMatrix(MVM));
+  Matrix4 MVM = rigTFormToMatrix(view.arcballEye) * Matrix4::makeScale(Cvec3(1, 1, 1) * g_arcballScale * g_arcballScreenRadius);
+  if (curSS.hasPerDrawBlock)
+    g_frameUniforms->sendModelViewNormalMatrix(curSS, MVM, normalMatrix(MVM));
+  else
+    sendModelViewNormalMatrix(curSS, MVM, normalMatrix(MVM));
 
   safe_glUniform3f(curSS.h_uColor, 0.27, 0.82, 0.35); // set color
-  g_sphere->draw(curSS);
+  g_sphere->getLod(g_sphere->selectLod(g_arcballScreenRadius)).draw(curSS);
 
   // switch back to solid mode
   glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 }
 
-static void drawStuff(const ShaderState& curSS, bool picking) {
-  // if we are not translating, update arcball scale
-  if (!(g_mouseMClickButton || (g_mouseLClickButton && g_mouseRClickButton) || (g_mouseLClickButton && !g_mouseRClickButton && g_spaceDown)))
-    updateArcballScale();
-
-  // build & send proj. matrix to vshader
-  const Matrix4 projmat = makeProjectionMatrix();
+static void sendViewUniforms(const ShaderState& curSS, const Matrix4& projmat,
+                             const Cvec3& eyeLight1, const Cvec3& eyeLight2) {
   sendProjectionMatrix(curSS, projmat);
-
-  const RigTForm eyeRbt = getPathAccumRbt(g_world, g_currentCameraNode);
-  const RigTForm invEyeRbt = inv(eyeRbt);
-
-  const Cvec3 eyeLight1 = Cvec3(invEyeRbt * Cvec4(g_light1, 1));
-  const Cvec3 eyeLight2 = Cvec3(invEyeRbt * Cvec4(g_light2, 1));
   safe_glUniform3f(curSS.h_uLight, eyeLight1[0], eyeLight1[1], eyeLight1[2]);
   safe_glUniform3f(curSS.h_uLight2, eyeLight2[0], eyeLight2[1], eyeLight2[2]);
+  if (g_lightClusters)
+    g_lightClusters->bind(curSS);
+}
+
+static int getDrawThreads() {
+  static const int cores = max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+  return max(1, min(cores, g_lastDrawItems / DRAW_ITEMS_PER_THREAD));
+}
+
+// Queries the robots' bounds against the depth buffer of the frame drawn so
+// far, for the next frames to skip the hidden ones
+static void issueOcclusionQueries(const ShaderState& curSS, const ViewContext& view) {
+  const ShaderState& boxSS = g_shaders->get(0);
+  glUseProgram(boxSS.program);
+  sendProjectionMatrix(boxSS, view.projection);
+  g_occlusionCuller->issueQueries(boxSS, *g_cube, view.projection, g_frustNear);
+  glUseProgram(curSS.program);
+
+  g_frameProfiler->addCount("occlusion_culled", g_occlusionCuller->getNumCulled());
+  g_frameProfiler->addCount("occlusion_queries", g_occlusionCuller->getNumQueries());
+}
+
+static void drawStuff(const ShaderState& curSS, bool picking, const ViewContext& view) {
+  TRACE_SCOPE("drawStuff");
+  // if we are not translating, update arcball scale
+  g_frameProfiler->beginPhase("arcball_scale");
+  if (!isTranslating())
+    updateArcballScale(view);
+
+  if (!picking && g_lightClusters) {
+    g_frameProfiler->beginPhase("light_clusters");
+    g_lightClusters->build(g_pointLights, view.invEyeRbt, view.projection, g_frustNear, g_frustFar,
+                           g_windowWidth, g_windowHeight);
+  }
+
+  // the instanced counterpart of curSS needs the same view state
+  g_frameProfiler->beginPhase("view_uniforms");
+  const ShaderState *instancedSS = NULL;
+  if (!picking && g_instanceBuffer) {
+    instancedSS = &g_shaders->get(g_shadingFeatures[g_activeShader] | SHADER_INSTANCED);
+    glUseProgram(instancedSS->program);
+    sendViewUniforms(*instancedSS, view.projection, view.eyeLight1, view.eyeLight2);
+    glUseProgram(curSS.program);
+  }
+  sendViewUniforms(curSS, view.projection, view.eyeLight1, view.eyeLight2);
 
   if (!picking) {
-    Drawer drawer(invEyeRbt, curSS);
-    g_world->accept(drawer);
+    Drawer drawer(view.invEyeRbt, curSS, g_frameUniforms.get(), instancedSS, g_instanceBuffer.get());
+    drawer.setLodView(g_frustFovY, g_windowHeight);
+    if (g_occlusionCulling) {
+      g_occlusionCuller->beginFrame();
+      drawer.setOcclusionCuller(g_occlusionCuller.get());
+    }
+    g_frameProfiler->beginPhase("traversal");
+    g_lastDrawItems = drawer.drawScene(*g_world, getDrawThreads());
+    g_frameProfiler->beginPhase("submission");
+    drawer.flush();
+
+    if (g_displayArcball && view.manipMode != EGO_MOTION)
+      drawArcBall(curSS, view);
 
-    if (g_displayArcball && shouldUseArcball())
-      drawArcBall(curSS);
+    if (g_occlusionCulling) {
+      g_frameProfiler->beginPhase("occlusion_queries");
+      issueOcclusionQueries(curSS, view);
+    }
+    g_frameProfiler->endPhase();
   }
   else {
-    Picker picker(invEyeRbt, curSS);
+    Picker picker(view.invEyeRbt, curSS, *g_pickBuffer);
     g_world->accept(picker);
-    glFlush();
-    g_currentPickedRbtNode = picker.getRbtNodeAtXY(g_mouseClickX, g_mouseClickY);
-    if (g_currentPickedRbtNode == g_groundNode)
-      g_currentPickedRbtNode = shared_ptr<SgRbtNode>(); // set to NULL
+  }
+}
 
-    cout << (g_currentPickedRbtNode ? "Part picked" : "No part picked") << endl;
+// Outlines the rubber band by clearing four one pixel wide scissor rectangles
+static void drawSelectionRect() {
+  const int x0 = min(g_rectX0, g_rectX1), x1 = max(g_rectX0, g_rectX1);
+  const int y0 = min(g_rectY0, g_rectY1), y1 = max(g_rectY0, g_rectY1);
+
+  GLfloat clearColor[4];
+  glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+  glClearColor(1, 1, 1, 1);
+  glEnable(GL_SCISSOR_TEST);
+  const int edges[4][4] = {
+    {x0, y0, x1 - x0 + 1, 1}, {x0, y1, x1 - x0 + 1, 1},
+    {x0, y0, 1, y1 - y0 + 1}, {x1, y0, 1, y1 - y0 + 1}
+  };
+  for (int i = 0; i < 4; ++i) {
+    glScissor(edges[i][0], edges[i][1], edges[i][2], edges[i][3]);
+    glClear(GL_COLOR_BUFFER_BIT);
   }
+  glDisable(GL_SCISSOR_TEST);
+  glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
 }
 
+static void applyPendingMotion();
+
 static void display() {
-  glUseProgram(g_shaderStates[g_activeShader]->program);
+  TRACE_SCOPE("display");
+  g_frameProfiler->beginFrame();
+  applyPendingMotion();
+  const ShaderState& curSS = g_shaders->get(getDrawFeatures());
+  glUseProgram(curSS.program);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-  drawStuff(*g_shaderStates[g_activeShader], false);
+  if (g_frameUniforms)
+    g_frameUniforms->beginFrame();
+
+  g_frameProfiler->beginPhase("eye_transform");
+  const ViewContext view = makeViewContext();
+  drawStuff(curSS, false, view);
+
+  if (g_frameUniforms)
+    g_frameUniforms->endFrame();
 
+  if (g_rectSelecting)
+    drawSelectionRect();
+
+  g_frameProfiler->beginPhase("swap");
   glutSwapBuffers();
+  g_frameProfiler->endFrame();
+  g_displayStamp = getDisplayStamp();
+  g_displayStampValid = true;
+
+  // the frame after the results arrive may draw fewer robots
+  if (g_occlusionCulling && g_occlusionCuller->hasPendingQueries())
+    glutPostRedisplay();
 
   checkGlErrors();
+
+  static bool firstFrame = true;
+  if (firstFrame) {
+    glFinish(); // so that the first frame counts until it is on screen
+    getStartupTimer().finish();
+    firstFrame = false;
+  }
 }
 
-static void pick() {
-  // We need to set the clear color to black, for pick rendering.
-  // so let's save the clear color
-  GLdouble clearColor[4];
-  glGetDoublev(GL_COLOR_CLEAR_VALUE, clearColor);
+static void writeFrameProfile(const char *filename) {
+  ofstream ofs(filename);
+  g_frameProfiler->writeCsv(ofs);
+  if (ofs)
+    cerr << "Frame time statistics written to " << filename << endl;
+  else
+    cerr << "Cannot write " << filename << endl;
+}
 
-  glClearColor(0, 0, 0, 0);
+static void rayCastPick() {
+  TRACE_SCOPE("rayCastPick");
+  RayPicker picker(makeViewContext().invEyeRbt);
+  g_world->accept(picker);
+  g_currentPickedRbtNode = picker.getRbtNodeAtXY(g_mouseClickX, g_mouseClickY, g_frustFovY, g_windowWidth, g_windowHeight);
+  if (g_currentPickedRbtNode == g_groundNode)
+    g_currentPickedRbtNode = shared_ptr<SgRbtNode>(); // set to NULL
+}
 
-  // using PICKING_SHADER as the shader
-  glUseProgram(g_shaderStates[PICKING_SHADER]->program);
+static PickBufferStamp getPickBufferStamp() {
+  PickBufferStamp stamp;
+  stamp.sceneGeneration = getSceneGeneration();
+  stamp.camera = g_currentCameraNode.get();
+  stamp.width = g_windowWidth;
+  stamp.height = g_windowHeight;
+  stamp.fovY = g_frustFovY;
+  return stamp;
+}
 
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  drawStuff(*g_shaderStates[PICKING_SHADER], true);
+// Renders object ids into the pick buffer unless it is already up to date
+static void updatePickBuffer() {
+  TRACE_SCOPE("updatePickBuffer");
+  const PickBufferStamp stamp = getPickBufferStamp();
+  if (g_pickBufferValid && g_pickBufferStamp == stamp)
+    return;
 
-  // Uncomment below and comment out the glutPostRedisplay in mouse(...) call back
-  // to see result of the pick rendering pass
-  // glutSwapBuffers();
+  g_pickBuffer->beginRender(g_windowWidth, g_windowHeight);
 
-  //Now set back the clear color
-  glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+  // using the picking permutation as the shader
+  const ShaderState& pickSS = g_shaders->get(SHADER_PICK);
+  glUseProgram(pickSS.program);
+  drawStuff(pickSS, true, makeViewContext());
 
-  checkGlErrors();
+  g_pickBuffer->endRender();
+
+  g_pickBufferStamp = stamp;
+  g_pickBufferValid = true;
+}
+
+static void pick() {
+  TRACE_SCOPE("pick");
+  if (g_rayCastPicking || !g_pickBuffer)
+    rayCastPick();
+  else {
+    updatePickBuffer();
+    g_currentPickedRbtNode = g_pickBuffer->getRbtNodeAtXY(g_mouseClickX, g_mouseClickY);
+    if (g_currentPickedRbtNode == g_groundNode)
+      g_currentPickedRbtNode = shared_ptr<SgRbtNode>(); // set to NULL
+  }
+
+  g_selectedRbtNodes.clear();
+  if (g_currentPickedRbtNode)
+    g_selectedRbtNodes.push_back(g_currentPickedRbtNode);
+
+  cout << (g_currentPickedRbtNode ? "Part picked" : "No part picked") << endl;
 }
 
+// Selects every part visible inside the rubber band rectangle
+static void rectSelect() {
+  updatePickBuffer();
+  g_pickBuffer->getRbtNodesInRect(g_rectX0, g_rectY0, g_rectX1, g_rectY1, g_selectedRbtNodes);
+  g_selectedRbtNodes.erase(remove(g_selectedRbtNodes.begin(), g_selectedRbtNodes.end(), g_groundNode),
+                           g_selectedRbtNodes.end());
+
+  g_currentPickedRbtNode = g_selectedRbtNodes.empty() ? shared_ptr<SgRbtNode>() : g_selectedRbtNodes[0];
+  cout << g_selectedRbtNodes.size() << " parts selected" << endl;
+}
+
+
 static void reshape(const int w, const int h) {
+  TRACE_SCOPE("reshape");
   g_windowWidth = w;
   g_windowHeight = h;
   glViewport(0, 0, w, h);
   cerr << "Size of window is now " << w << "x" << h << endl;
   g_arcballScreenRadius = max(1.0, min(h, w) * 0.25);
   updateFrustFovY();
-  glutPostRedisplay();
+  requestRedisplay();
 }
 
 static Cvec3 getArcballDirection(const Cvec2& p, const double r) {
@@ -684,17 +988,14 @@ static Cvec3 getArcballDirection(const Cvec2& p, const double r) {
     return normalize(Cvec3(p, sqrt(r*r - n2)));
 }
 
-static RigTForm moveArcball(const Cvec2& p0, const Cvec2& p1) {
-  const Matrix4 projMatrix = makeProjectionMatrix();
-  const RigTForm eyeInverse = inv(getPathAccumRbt(g_world, g_currentCameraNode));
-  const Cvec3 arcballCenter = getArcballRbt().getTranslation();
-  const Cvec3 arcballCenter_ec = Cvec3(eyeInverse * Cvec4(arcballCenter, 1));
+static RigTForm moveArcball(const ViewContext& view, const Cvec2& p0, const Cvec2& p1) {
+  const Cvec3 arcballCenter_ec = view.arcballEye.getTranslation();
 
   if (arcballCenter_ec[2] > -CS175_EPS)
     return RigTForm();
 
   Cvec2 ballScreenCenter = getScreenSpaceCoord(arcballCenter_ec,
-                                               projMatrix, g_frustNear, g_frustFovY, g_windowWidth, g_windowHeight);
+                                               view.projection, g_frustNear, g_frustFovY, g_windowWidth, g_windowHeight);
   const Cvec3 v0 = getArcballDirection(p0 - ballScreenCenter, g_arcballScreenRadius);
   const Cvec3 v1 = getArcballDirection(p1 - ballScreenCenter, g_arcballScreenRadius);
 
@@ -705,17 +1006,17 @@ static RigTForm doMtoOwrtA(const RigTForm& M, const RigTForm& O, const RigTForm&
   return A * M * inv(A) * O;
 }
 
-static RigTForm getMRbt(const double dx, const double dy) {
+static RigTForm getMRbt(const ViewContext& view, const double dx, const double dy) {
   RigTForm M;
 
   if (g_mouseLClickButton && !g_mouseRClickButton && !g_spaceDown) {
-    if (shouldUseArcball())
-      M = moveArcball(Cvec2(g_mouseClickX, g_mouseClickY), Cvec2(g_mouseClickX + dx, g_mouseClickY + dy));
+    if (view.manipMode != EGO_MOTION)
+      M = moveArcball(view, Cvec2(g_mouseClickX, g_mouseClickY), Cvec2(g_mouseClickX + dx, g_mouseClickY + dy));
     else
       M = RigTForm(Quat::makeXRotation(-dy) * Quat::makeYRotation(dx));
   }
   else {
-    double movementScale = getManipMode() == EGO_MOTION ? 0.02 : g_arcballScale;
+    double movementScale = view.manipMode == EGO_MOTION ? 0.02 : g_arcballScale;
     if (g_mouseRClickButton && !g_mouseLClickButton) {
       M = RigTForm(Cvec3(dx, dy, 0) * movementScale);
     }
@@ -724,7 +1025,7 @@ static RigTForm getMRbt(const double dx, const double dy) {
     }
   }
 
-  switch (getManipMode()) {
+  switch (view.manipMode) {
   case ARCBALL_ON_PICKED:
     break;
   case ARCBALL_ON_SKY:
@@ -748,41 +1049,79 @@ static RigTForm makeMixedFrame(const RigTForm& objRbt, const RigTForm& eyeRbt) {
 // o = a (A')^-1 O
 //   => a M (A')^-1 O = l A' M (A')^-1 O
 
-static void motion(const int x, const int y) {
-  if (!g_mouseClickDown)
+// Manipulates the scene by the mouse movement since the last one applied.
+// Arcball rotations compose exactly and translations add up, so there applying
+// the movement of several motion events at once gives the same result as
+// applying them one by one. Ego motion rotations (about x by -dy, then y by
+// dx) do not commute, so for them the coalesced result is only approximate,
+// the closer the smaller the movement between frames.
+static void applyPendingMotion() {
+  if (!g_motionPending)
     return;
+  TRACE_SCOPE("applyPendingMotion");
+  g_motionPending = false;
 
-  const double dx = x - g_mouseClickX;
-  const double dy = g_windowHeight - y - 1 - g_mouseClickY;
+  const double dx = g_pendingMotionX - g_mouseClickX;
+  const double dy = g_pendingMotionY - g_mouseClickY;
 
-  const RigTForm M = getMRbt(dx, dy);   // the "action" matrix
+  const ViewContext view = makeViewContext();
+  const RigTForm M = getMRbt(view, dx, dy);   // the "action" matrix
 
   // the matrix for the auxiliary frame (the w.r.t.)
-  RigTForm A = makeMixedFrame(getArcballRbt(), getPathAccumRbt(g_world, g_currentCameraNode));
+  const RigTForm A = makeMixedFrame(view.arcballRbt, view.eyeRbt);
 
-  shared_ptr<SgRbtNode> target;
-  switch (getManipMode()) {
+  vector<shared_ptr<SgTransformNode> > targets;
+  switch (view.manipMode) {
   case ARCBALL_ON_PICKED:
-    target = g_currentPickedRbtNode;
+    targets.assign(g_selectedRbtNodes.begin(), g_selectedRbtNodes.end());
     break;
   case ARCBALL_ON_SKY:
-    target = g_skyNode;
+    targets.push_back(g_skyNode);
     break;
   case EGO_MOTION:
-    target = g_currentCameraNode;
+    targets.push_back(g_currentCameraNode);
     break;
   }
 
-  A = inv(getPathAccumRbt(g_world, target, 1)) * A;
-
-  target->setRbt(doMtoOwrtA(M, target->getRbt(), A));
+  // one traversal finds the parent frames of all targets. Targets below another
+  // target already move with it, so only the outermost ones are changed.
+  vector<RigTForm> parentRbts;
+  vector<bool> nested;
+  getPathAccumRbts(g_world, targets, parentRbts, 1, &nested);
+
+  for (int i = 0, n = targets.size(); i < n; ++i) {
+    if (nested[i])
+      continue;
+    shared_ptr<SgRbtNode> target = static_pointer_cast<SgRbtNode>(targets[i]);
+    target->setRbt(doMtoOwrtA(M, target->getRbt(), inv(parentRbts[i]) * A));
+  }
 
   g_mouseClickX += dx;
   g_mouseClickY += dy;
-  glutPostRedisplay();  // we always redraw if we changed the scene
+}
+
+static void motion(const int x, const int y) {
+  TRACE_SCOPE("motion");
+  if (g_rectSelecting) {
+    g_rectX1 = x;
+    g_rectY1 = g_windowHeight - y - 1;
+    requestRedisplay();
+    return;
+  }
+
+  if (!g_mouseClickDown)
+    return;
+
+  // applied by the next frame, together with any motion arriving before it
+  g_motionPending = true;
+  g_pendingMotionX = x;
+  g_pendingMotionY = g_windowHeight - y - 1;
+  glutPostRedisplay();
 }
 
 static void mouse(const int button, const int state, const int x, const int y) {
+  TRACE_SCOPE("mouse");
+  applyPendingMotion();
   g_mouseClickX = x;
   g_mouseClickY = g_windowHeight - y - 1;  // conversion from GLUT window-coordinate-system to OpenGL window-coordinate-system
 
@@ -796,25 +1135,38 @@ static void mouse(const int button, const int state, const int x, const int y) {
 
   g_mouseClickDown = g_mouseLClickButton || g_mouseRClickButton || g_mouseMClickButton;
 
-  if (g_pickingMode && button == GLUT_LEFT_BUTTON && state == GLUT_DOWN) {
+  if (g_rectSelectMode && button == GLUT_LEFT_BUTTON && state == GLUT_DOWN) {
+    g_rectSelecting = true;
+    g_rectX0 = g_rectX1 = g_mouseClickX;
+    g_rectY0 = g_rectY1 = g_mouseClickY;
+  }
+  else if (g_rectSelecting && button == GLUT_LEFT_BUTTON && state == GLUT_UP) {
+    g_rectSelecting = false;
+    g_rectSelectMode = false;
+    rectSelect();
+    cerr << "Rectangle select mode is off" << endl;
+  }
+  else if (g_pickingMode && button == GLUT_LEFT_BUTTON && state == GLUT_DOWN) {
     pick();
     g_pickingMode = false;
     cerr << "Picking mode is off" << endl;
-    glutPostRedisplay(); // request redisplay since the arcball will have moved
   }
-  glutPostRedisplay();
+  requestRedisplay();
 }
 
 static void keyboardUp(const unsigned char key, const int x, const int y) {
+  applyPendingMotion();
   switch (key) {
   case ' ':
     g_spaceDown = false;
     break;
   }
-  glutPostRedisplay();
+  requestRedisplay();
 }
 
 static void keyboard(const unsigned char key, const int x, const int y) {
+  TRACE_SCOPE("keyboard");
+  applyPendingMotion();
   if (animating) {
     return;
   }
@@ -830,13 +1182,20 @@ static void keyboard(const unsigned char key, const int x, const int y) {
     << "s\t\tsave screenshot\n"
     << "f\t\tToggle flat shading on/off.\n"
     << "p\t\tUse mouse to pick a part to edit\n"
+    << "r\t\tToggle ray cast / pick buffer picking\n"
+    << "b\t\tDrag a rectangle to select many parts\n"
     << "v\t\tCycle view\n"
+    << "t\t\tWrite frame time statistics to " << g_frameProfileFile << "\n"
+    << "o\t\tToggle occlusion culling of hidden robots\n"
     << "drag left mouse to rotate\n" << endl;
     break;
   case 's':
     glFlush();
     writePpmScreenshot(g_windowWidth, g_windowHeight, "out.ppm");
     break;
+  case 't':
+    writeFrameProfile(g_frameProfileFile);
+    break;
   case 'f':
     g_activeShader = (g_activeShader + 1) % g_numRegularShaders;
     break;
@@ -855,6 +1214,28 @@ static void keyboard(const unsigned char key, const int x, const int y) {
     g_pickingMode = !g_pickingMode;
     cerr << "Picking mode is " << (g_pickingMode ? "on" : "off") << endl;
     break;
+  case 'r':
+    if (!g_pickBuffer) {
+      cerr << "Pick buffer needs framebuffer objects; picking by ray casting" << endl;
+      break;
+    }
+    g_rayCastPicking = !g_rayCastPicking;
+    cerr << "Picking by " << (g_rayCastPicking ? "ray casting" : "pick buffer") << endl;
+    break;
+  case 'b':
+    if (!g_pickBuffer) {
+      cerr << "Rectangle select needs framebuffer objects" << endl;
+      break;
+    }
+    g_rectSelectMode = !g_rectSelectMode;
+    cerr << "Rectangle select mode is " << (g_rectSelectMode ? "on" : "off") << endl;
+    break;
+  case 'o':
+    g_occlusionCulling = !g_occlusionCulling;
+    if (g_occlusionCulling)
+      g_occlusionCuller->reset();                // the old results may be stale
+    cerr << "Occlusion culling is " << (g_occlusionCulling ? "on" : "off") << endl;
+    break;
   case 'm':
     g_activeCameraFrame = SkyMode((g_activeCameraFrame+1) % 2);
     cerr << "Editing sky eye w.r.t. " << (g_activeCameraFrame == WORLD_SKY ? "world-sky frame\n" : "sky-sky frame\n") << endl;
@@ -894,8 +1275,7 @@ static void keyboard(const unsigned char key, const int x, const int y) {
       cout << "Cannot play animation with fewer than 4 keyframes." << endl;
       break;
     }
-    animating = !animating;
-    animateTimerCallback(0);
+    startAnimation();
     break;
   case '+':
     g_msBetweenKeyFrames -= 100;
@@ -906,11 +1286,13 @@ static void keyboard(const unsigned char key, const int x, const int y) {
     cout << g_msBetweenKeyFrames << " ms between keyframes." << endl;
     break;
   }
-  glutPostRedisplay();
+  requestRedisplay();
 }
 
 static void initGlutState(int argc, char * argv[]) {
   glutInit(&argc, argv);                                  // initialize Glut based on cmd-line args
+  if (argc > 1)
+    g_meshFile = argv[1];                                 // what is left after Glut's own arguments
 #ifdef __MAC__
   glutInitDisplayMode(GLUT_3_2_CORE_PROFILE|GLUT_RGBA|GLUT_DOUBLE|GLUT_DEPTH); // core profile flag is required for GL 3.2 on Mac
 #else
@@ -941,23 +1323,63 @@ static void initGLState() {
   glReadBuffer(GL_BACK);
   if (!g_Gl2Compatible)
     glEnable(GL_FRAMEBUFFER_SRGB);
+
+  g_frameProfiler.reset(new FrameProfiler());
 }
 
 static void initShaders() {
-  g_shaderStates.resize(g_numShaders);
-  for (int i = 0; i < g_numShaders; ++i) {
-    if (g_Gl2Compatible)
-      g_shaderStates[i].reset(new ShaderState(g_shaderFilesGl2[i][0], g_shaderFilesGl2[i][1]));
-    else
-      g_shaderStates[i].reset(new ShaderState(g_shaderFiles[i][0], g_shaderFiles[i][1]));
+  if (g_Gl2Compatible)
+    g_shaders.reset(new ShaderPermutations(g_shaderFilesGl2[0], g_shaderFilesGl2[1], g_shaderCacheDir));
+  else
+    g_shaders.reset(new ShaderPermutations(g_shaderFiles[0], g_shaderFiles[1], g_shaderCacheDir));
+
+  // Shapes sharing a geometry are drawn instanced when vertex attribute
+  // divisors are available
+#ifndef __MAC__
+  if (!g_Gl2Compatible && GLEW_VERSION_3_3)
+#else
+  if (!g_Gl2Compatible)
+#endif
+    g_instanceBuffer.reset(new InstanceBuffer());
+
+  // GL2 shaders take their matrices as plain uniforms, and light the scene
+  // with two lights only
+  if (!g_Gl2Compatible) {
+    g_frameUniforms.reset(new FrameUniforms());
+    g_lightClusters.reset(new LightClusters());
   }
+
+  // The permutations the first frame and picking use are built up front in
+  // one batch; the others, such as for solid shading, on first use
+  vector<unsigned> features;
+  features.push_back(getDrawFeatures());
+  features.push_back(SHADER_PICK);
+  if (g_instanceBuffer)
+    features.push_back(g_shadingFeatures[g_activeShader] | SHADER_INSTANCED);
+  g_shaders->prepare(features);
+}
+
+static void initPickBuffer() {
+#ifndef __MAC__
+  if (!GLEW_VERSION_3_0 && !GLEW_ARB_framebuffer_object) {
+    cerr << "No framebuffer objects; picking by ray casting only" << endl;
+    return;
+  }
+#endif
+  g_pickBuffer.reset(new PickBuffer(!g_Gl2Compatible));
 }
 
 static void initGeometry() {
+  g_geometryArena.reset(new GeometryArena());
+  g_lodRegistry.reset(new LodRegistry());
   initGround();
   initCubes();
   initSphere();
   initRobots();
+  if (g_meshFile) {
+    ScopedPhase phase(getStartupTimer(), string("load ") + g_meshFile);
+    g_mesh = objLoadGeometry(*g_geometryArena, g_meshFile);
+  }
 }
 
 static void constructRobot(shared_ptr<SgTransformNode> base, const Cvec3& color) {
@@ -1050,17 +1472,95 @@ static void initScene() {
   g_world->addChild(g_robot1Node);
   g_world->addChild(g_robot2Node);
 
+  g_occlusionCuller.reset(new OcclusionCuller());
+  g_occlusionCuller->addCandidate(g_robot1Node);
+  g_occlusionCuller->addCandidate(g_robot2Node);
+
+  // A crowd of CS175_ROBOTS more robots in rows of five behind the first two
+  const char *crowd = getenv("CS175_ROBOTS");
+  for (int i = 0, n = crowd ? max(0, atoi(crowd)) : 0; i < n; ++i) {
+    shared_ptr<SgRbtNode> robot(new SgRbtNode(RigTForm(Cvec3(-4 + 2 * (i % 5), 1, -3 - 2 * (i / 5)))));
+    constructRobot(robot, Cvec3(0.3 + 0.7 * (i % 3 == 0), 0.3 + 0.7 * (i % 3 == 1), 0.3 + 0.7 * (i % 3 == 2)));
+    g_world->addChild(robot);
+    g_occlusionCuller->addCandidate(robot);
+  }
+
+  if (g_mesh) {
+    g_meshNode.reset(new SgRbtNode(RigTForm(Cvec3(0, 1, -2))));
+    g_meshNode->addChild(shared_ptr<MyShapeNode>(
+                           new MyShapeNode(g_mesh, Cvec3(0.8, 0.8, 0.8))));
+    g_world->addChild(g_meshNode);
+  }
+
   g_currentCameraNode = g_skyNode;
 }
 
+// The two scene lights, unattenuated, then the number of small colored lights
+// given by the CS175_POINT_LIGHTS environment variable scattered above the ground
+static void initLights() {
+  g_pointLights.push_back(PointLight(g_light1, Cvec3(1, 1, 1)));
+  g_pointLights.push_back(PointLight(g_light2, Cvec3(1, 1, 1)));
+
+  const char *count = getenv("CS175_POINT_LIGHTS");
+  const int n = count ? max(0, atoi(count)) : 0;
+  unsigned int seed = 175; // the same lights on every run
+  for (int i = 0; i < n; ++i) {
+    double r[7];
+    for (int j = 0; j < 7; ++j) {
+      seed = seed * 1664525 + 1013904223;
+      r[j] = (seed >> 8) / double(1 << 24);
+    }
+    const Cvec3 position((r[0] * 2 - 1) * g_groundSize, g_groundY + 0.2 + r[1] * 2, (r[2] * 2 - 1) * g_groundSize);
+    g_pointLights.push_back(PointLight(position, Cvec3(r[3], r[4], r[5]), 1 + r[6] * 2));
+  }
+}
+
+// Prints the startup phases on exit as a table, or as JSON, when the
+// CS175_STARTUP_REPORT environment variable is "table" or "json"
+static void reportStartupTimes() {
+  const char *format = getenv("CS175_STARTUP_REPORT");
+  if (!format)
+    return;
+  if (string(format) == "json")
+    getStartupTimer().writeJson(cerr);
+  else
+    getStartupTimer().printTable(cerr);
+}
+
+// Also written on exit when the CS175_FRAME_PROFILE environment variable names
+// a file
+static void writeFrameProfileOnExit() {
+  const char *filename = getenv("CS175_FRAME_PROFILE");
+  if (filename && g_frameProfiler)
+    writeFrameProfile(filename);
+}
+
+#ifdef CS175_TRACE
+static void writeTraceOnExit() {
+  writeChromeTrace("trace.json");
+  cerr << "Trace written to trace.json" << endl;
+}
+#endif
+
 int main(int argc, char * argv[]) {
   try {
+    PhaseTimer& startup = getStartupTimer();
+    atexit(reportStartupTimes);
+    atexit(writeFrameProfileOnExit);
+#ifdef CS175_TRACE
+    atexit(writeTraceOnExit);
+#endif
+
+    startup.begin("initGlutState");
     initGlutState(argc,argv);
+    startup.end();
 
     // on Mac, we shouldn't use GLEW.
 
 #ifndef __MAC__
+    startup.begin("glewInit");
     glewInit(); // load the OpenGL extensions
+    startup.end();
 #endif
 
     cout << (g_Gl2Compatible ? "Will use OpenGL 2.x / GLSL 1.0" : "Will use OpenGL 3.x / GLSL 1.5") << endl;
@@ -1072,11 +1572,24 @@ int main(int argc, char * argv[]) {
       throw runtime_error("Error: card/driver does not support OpenGL Shading Language v1.0");
 #endif
 
+    startup.begin("initGLState");
     initGLState();
+    startup.end();
+    startup.begin("initShaders");
     initShaders();
+    startup.end();
+    startup.begin("initPickBuffer");
+    initPickBuffer();
+    startup.end();
+    startup.begin("initGeometry");
     initGeometry();
+    startup.end();
+    startup.begin("initScene");
     initScene();
+    initLights();
+    startup.end();
 
+    startup.begin("first frame"); // ended by display
     glutMainLoop();
     return 0;
   }
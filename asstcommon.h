@@ -14,6 +14,12 @@
 
 extern const bool g_Gl2Compatible;
 
+// Uniform buffer binding point of the PerDraw block (see FrameUniforms)
+static const GLuint PER_DRAW_UNIFORM_BINDING = 0;
+
+// First of the three texture units holding the light buffers (see LightClusters)
+static const GLint LIGHT_TEXTURE_UNIT = 1;
+
 struct ShaderState {
   GlProgram program;
 
@@ -24,14 +30,35 @@ struct ShaderState {
   GLint h_uNormalMatrix;
   GLint h_uColor;
   GLint h_uIdColor;
+  GLint h_uId;
+  GLint h_uDrawIndex;
+
+  // Handles to the clustered light uniforms, only in GL3 lit shaders
+  GLint h_uLightData, h_uLightClusters, h_uLightIndices;
+  GLint h_uClusterTileSize, h_uClusterZ, h_uClusterDims;
+
+  // Whether the shader takes its matrices from the PerDraw uniform block
+  bool hasPerDrawBlock;
 
   // Handles to vertex attributes
   GLint h_aPosition;
   GLint h_aNormal;
 
+  // Handles to per instance vertex attributes, only in instanced shaders
+  GLint h_aModelViewMatrix;
+  GLint h_aNormalMatrix;
+  GLint h_aColor;
+
   ShaderState(const char* vsfn, const char* fsfn) {
     readAndCompileShader(program, vsfn, fsfn);
+    retrieveHandles();
+  }
+
+  // Leaves the program to be linked elsewhere (see ShaderProgramCache), after
+  // which retrieveHandles must be called
+  ShaderState() {}
 
+  void retrieveHandles() {
     const GLuint h = program; // short hand
 
     // Retrieve handles to uniform variables
@@ -42,10 +69,31 @@ struct ShaderState {
     h_uNormalMatrix = safe_glGetUniformLocation(h, "uNormalMatrix");
     h_uColor = safe_glGetUniformLocation(h, "uColor");
     h_uIdColor = safe_glGetUniformLocation(h, "uIdColor");
+    h_uId = safe_glGetUniformLocation(h, "uId");
+    h_uDrawIndex = safe_glGetUniformLocation(h, "uDrawIndex");
+    h_uLightData = safe_glGetUniformLocation(h, "uLightData");
+    h_uLightClusters = safe_glGetUniformLocation(h, "uLightClusters");
+    h_uLightIndices = safe_glGetUniformLocation(h, "uLightIndices");
+    h_uClusterTileSize = safe_glGetUniformLocation(h, "uClusterTileSize");
+    h_uClusterZ = safe_glGetUniformLocation(h, "uClusterZ");
+    h_uClusterDims = safe_glGetUniformLocation(h, "uClusterDims");
+
+    // Retrieve the uniform block, only present in GL3 shaders
+    hasPerDrawBlock = false;
+    if (!g_Gl2Compatible) {
+      const GLuint perDrawBlock = glGetUniformBlockIndex(h, "PerDraw");
+      if (perDrawBlock != GL_INVALID_INDEX) {
+        glUniformBlockBinding(h, perDrawBlock, PER_DRAW_UNIFORM_BINDING);
+        hasPerDrawBlock = true;
+      }
+    }
 
     // Retrieve handles to vertex attributes
     h_aPosition = safe_glGetAttribLocation(h, "aPosition");
     h_aNormal = safe_glGetAttribLocation(h, "aNormal");
+    h_aModelViewMatrix = safe_glGetAttribLocation(h, "aModelViewMatrix");
+    h_aNormalMatrix = safe_glGetAttribLocation(h, "aNormalMatrix");
+    h_aColor = safe_glGetAttribLocation(h, "aColor");
 
     if (!g_Gl2Compatible)
       glBindFragDataLocation(h, 0, "fragColor");
@@ -64,5 +112,11 @@ inline void sendModelViewNormalMatrix(const ShaderState& curSS, const Matrix4& M
   safe_glUniformMatrix4fv(curSS.h_uNormalMatrix, glmatrix);
 }
 
+// same for single precision matrices, which are already in OpenGL layout
+inline void sendModelViewNormalMatrix(const ShaderState& curSS, const Matrix4f& MVM, const Matrix4f& NMVM) {
+  safe_glUniformMatrix4fv(curSS.h_uModelViewMatrix, MVM.data());
+  safe_glUniformMatrix4fv(curSS.h_uNormalMatrix, NMVM.data());
+}
+
 
 #endif
@@ -0,0 +1,133 @@
+#ifndef BOUNDS_H
+#define BOUNDS_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "cvec.h"
+#include "matrix4.h"
+
+// An axis aligned bounding box. A default constructed box is empty, and
+// grows to contain whatever points or boxes are added to it.
+struct Aabb {
+  Cvec3 lo, hi;
+
+  Aabb()
+    : lo(std::numeric_limits<double>::max())
+    , hi(-std::numeric_limits<double>::max()) {}
+
+  Aabb(const Cvec3& lo, const Cvec3& hi) : lo(lo), hi(hi) {}
+
+  bool isEmpty() const {
+    return lo[0] > hi[0] || lo[1] > hi[1] || lo[2] > hi[2];
+  }
+
+  Cvec3 center() const {
+    return (lo + hi) * 0.5;
+  }
+
+  Cvec3 extent() const {
+    return hi - lo;
+  }
+
+  Aabb& add(const Cvec3& p) {
+    for (int i = 0; i < 3; ++i) {
+      lo[i] = std::min(lo[i], p[i]);
+      hi[i] = std::max(hi[i], p[i]);
+    }
+    return *this;
+  }
+
+  Aabb& add(const Aabb& b) {
+    if (!b.isEmpty())
+      add(b.lo).add(b.hi);
+    return *this;
+  }
+};
+
+// Returns the bounding box of the affine image of `b' under `m'
+inline Aabb transformAabb(const Matrix4& m, const Aabb& b) {
+  assert(isAffine(m));
+  if (b.isEmpty())
+    return b;
+  const Cvec3 c = b.center(), h = b.extent() * 0.5;
+  Cvec3 nc, nh;
+  for (int i = 0; i < 3; ++i) {
+    nc[i] = m(i,3);
+    for (int j = 0; j < 3; ++j) {
+      nc[i] += m(i,j) * c[j];
+      nh[i] += std::abs(m(i,j)) * h[j];
+    }
+  }
+  return Aabb(nc - nh, nc + nh);
+}
+
+// The bounding primitive of a piece of geometry in its own object frame:
+// either the box itself, or the ellipsoid inscribed in the box.
+struct ShapeBound {
+  enum Kind {BOX, ELLIPSOID};
+
+  Kind kind;
+  Aabb box;
+
+  ShapeBound() : kind(BOX) {}
+  ShapeBound(Kind kind, const Aabb& box) : kind(kind), box(box) {}
+};
+
+// Slab test of the ray o + t d against `b'. On a hit stores the entry and exit
+// parameters into tNear and tFar (tNear may be negative if o is inside).
+inline bool intersectRayAabb(const Cvec3& o, const Cvec3& d, const Aabb& b, double& tNear, double& tFar) {
+  tNear = -std::numeric_limits<double>::max();
+  tFar = std::numeric_limits<double>::max();
+  for (int i = 0; i < 3; ++i) {
+    if (std::abs(d[i]) < CS175_EPS3) {
+      if (o[i] < b.lo[i] || o[i] > b.hi[i])
+        return false;
+      continue;
+    }
+    const double invD = 1 / d[i];
+    double t0 = (b.lo[i] - o[i]) * invD, t1 = (b.hi[i] - o[i]) * invD;
+    if (t0 > t1)
+      std::swap(t0, t1);
+    tNear = std::max(tNear, t0);
+    tFar = std::min(tFar, t1);
+    if (tNear > tFar)
+      return false;
+  }
+  return true;
+}
+
+// Intersects the ray o + t d with the shape bound, returning in t the nearest
+// hit with t > 0. The ray is given in the same object frame as the bound.
+inline bool intersectRayShapeBound(const Cvec3& o, const Cvec3& d, const ShapeBound& s, double& t) {
+  double t0, t1;
+  if (s.kind == ShapeBound::BOX) {
+    if (!intersectRayAabb(o, d, s.box, t0, t1))
+      return false;
+  }
+  else {
+    // scale the ellipsoid to a unit sphere, which leaves t unchanged
+    const Cvec3 c = s.box.center(), r = s.box.extent() * 0.5;
+    Cvec3 so, sd;
+    for (int i = 0; i < 3; ++i) {
+      if (r[i] < CS175_EPS)
+        return false;
+      so[i] = (o[i] - c[i]) / r[i];
+      sd[i] = d[i] / r[i];
+    }
+    const double a = dot(sd, sd), b = dot(so, sd), cc = dot(so, so) - 1;
+    const double disc = b * b - a * cc;
+    if (disc < 0 || a < CS175_EPS2)
+      return false;
+    const double sq = std::sqrt(disc);
+    t0 = (-b - sq) / a;
+    t1 = (-b + sq) / a;
+  }
+  if (t1 <= 0)
+    return false;
+  t = t0 > 0 ? t0 : t1;
+  return true;
+}
+
+#endif
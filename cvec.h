@@ -10,6 +10,13 @@ static const double CS175_EPS = 1e-8;
 static const double CS175_EPS2 = CS175_EPS * CS175_EPS;
 static const double CS175_EPS3 = CS175_EPS * CS175_EPS * CS175_EPS;
 
+// Aligns a member or type to 16 bytes, as SIMD loads want
+#if __GNUG__
+#   define CS175_ALIGN16 __attribute__((aligned(16)))
+#else
+#   define CS175_ALIGN16 __declspec(align(16))
+#endif
+
 
 template <typename T, int n>
 class Cvec {
@@ -2,33 +2,152 @@
 #define DRAWER_H
 
 #include <vector>
+#include <algorithm>
+#include <functional>
 
 #include "scenegraph.h"
 #include "asstcommon.h"
+#include "frameuniforms.h"
+#include "geometry.h"
+#include "arcball.h"
+#include "occlusionculler.h"
+#include "drawlist.h"
 
+// Draws the scene graph. The CPU work of each shape is done by a
+// DrawListBuilder (see drawlist.h), and the resulting DrawItem submitted. As
+// a visitor, every shape is drawn as soon as it is visited; drawScene instead
+// builds the whole draw list first, on several threads, and then submits it.
+//
+// By default a submitted shape is drawn right away. If given FrameUniforms
+// and the shader reads the PerDraw block, the matrices are instead collected
+// and the draws are issued by flush(), after all matrices were uploaded in
+// one go.
+//
+// If also given an instanced shader (with the same lighting as curSS) and an
+// InstanceBuffer, shapes that have an instance key are instead gathered by key
+// and flush() issues one instanced draw per group, as a single multi draw
+// indirect call per GeometryPage where available.
+//
+// After setLodView, shapes with several levels of detail are drawn at the
+// level matching the screen size of their bound. After setOcclusionCuller,
+// the subtrees the culler found occluded are skipped.
 class Drawer : public SgNodeVisitor {
 protected:
-  std::vector<RigTForm> rbtStack_;
+  struct DrawPacket {
+    SgShapeNode *shape;
+    int drawIndex;       // into frameUniforms_
+    int lod;
+  };
+
+  struct Instance {
+    const void *key;
+    SgShapeNode *shape;
+    int lod;
+    InstanceAttribs attribs;
+
+    bool operator < (const Instance& o) const {
+      return std::less<const void*>()(key, o.key);
+    }
+  };
+
   const ShaderState& curSS_;
+  FrameUniforms *frameUniforms_;
+  std::vector<DrawPacket> packets_;
+
+  const ShaderState *instancedSS_;
+  InstanceBuffer *instanceBuffer_;
+  std::vector<Instance> instances_;
+
+  RigTForm initialRbt_;
+  DrawListOptions options_;
+  std::vector<DrawItem> items_;  // built but not submitted yet
+  DrawListBuilder builder_;      // appends to items_ while visiting
+
+  void submit(const DrawItem& item) {
+    if (item.instanceKey) {
+      Instance inst;
+      inst.key = item.instanceKey;
+      inst.shape = item.shape;
+      inst.lod = item.lod;
+      inst.attribs.set(item.MVM, item.NMVM, item.shape->getColor());
+      instances_.push_back(inst);
+    }
+    else if (frameUniforms_) {
+      DrawPacket p;
+      p.shape = item.shape;
+      p.drawIndex = frameUniforms_->add(item.MVM, item.NMVM);
+      p.lod = item.lod;
+      packets_.push_back(p);
+    }
+    else {
+      sendModelViewNormalMatrix(curSS_, item.MVM, item.NMVM);
+      item.shape->draw(curSS_, item.lod);
+    }
+  }
+
+  void flushInstances() {
+    // group by key, keeping traversal order within a group
+    std::stable_sort(instances_.begin(), instances_.end());
+
+    std::vector<InstanceAttribs> attribs(instances_.size());
+    for (int i = 0, n = instances_.size(); i < n; ++i) {
+      attribs[i] = instances_[i].attribs;
+    }
+    instanceBuffer_->upload(&attribs[0], attribs.size());
+
+    InstancedDrawList draws;
+    for (int first = 0, n = instances_.size(); first < n;) {
+      int last = first + 1;
+      while (last < n && instances_[last].key == instances_[first].key)
+        ++last;
+      instances_[first].shape->addInstancedDraw(draws, first, last - first, instances_[first].lod);
+      first = last;
+    }
+
+    glUseProgram(instancedSS_->program);
+    draws.submit(*instancedSS_, *instanceBuffer_);
+    glUseProgram(curSS_.program);
+    countGlCalls(2);
+    instances_.clear();
+  }
+
 public:
-  Drawer(const RigTForm& initialRbt, const ShaderState& curSS)
-    : rbtStack_(1, initialRbt)
-    , curSS_(curSS) {}
+  Drawer(const RigTForm& initialRbt, const ShaderState& curSS, FrameUniforms *frameUniforms = NULL,
+         const ShaderState *instancedSS = NULL, InstanceBuffer *instanceBuffer = NULL)
+    : curSS_(curSS)
+    , frameUniforms_(curSS.hasPerDrawBlock ? frameUniforms : NULL)
+    , instancedSS_(instanceBuffer ? instancedSS : NULL)
+    , instanceBuffer_(instancedSS ? instanceBuffer : NULL)
+    , initialRbt_(initialRbt)
+    , builder_(RigTFormf(initialRbt), options_, items_) {
+    options_.instancing = instancedSS_ != NULL;
+  }
+
+  // Turns on levels of detail for a view with the given vertical field of
+  // view (in degrees) and height in pixels
+  void setLodView(double fovY, int screenHeight) {
+    options_.lodFovY = fovY;
+    options_.lodScreenHeight = screenHeight;
+  }
+
+  void setOcclusionCuller(OcclusionCuller *culler) {
+    options_.culler = culler;
+  }
 
   virtual bool visit(SgTransformNode& node) {
-    rbtStack_.push_back(rbtStack_.back() * node.getRbt());
-    return true;
+    return builder_.visit(node);
   }
 
   virtual bool postVisit(SgTransformNode& node) {
-    rbtStack_.pop_back();
-    return true;
+    return builder_.postVisit(node);
   }
 
   virtual bool visit(SgShapeNode& shapeNode) {
-    const Matrix4 MVM = rigTFormToMatrix(rbtStack_.back()) * shapeNode.getAffineMatrix();
-    sendModelViewNormalMatrix(curSS_, MVM, normalMatrix(MVM));
-    shapeNode.draw(curSS_);
+    builder_.visit(shapeNode);
+    for (int i = 0, n = items_.size(); i < n; ++i) {
+      submit(items_[i]);
+    }
+    items_.clear();
     return true;
   }
 
@@ -36,6 +155,33 @@ public:
     return true;
   }
 
+  // Draws the subtree at `root', the traversal being split among numThreads
+  // threads, and returns the number of shapes drawn. The GL calls are all
+  // made from the calling thread
+  int drawScene(SgTransformNode& root, int numThreads) {
+    buildDrawList(root, initialRbt_, options_, items_, numThreads);
+    const int n = items_.size();
+    for (int i = 0; i < n; ++i) {
+      submit(items_[i]);
+    }
+    items_.clear();
+    return n;
+  }
+
+  // Issues the draws collected during traversal, if any
+  void flush() {
+    if (!packets_.empty()) {
+      frameUniforms_->upload();
+      for (int i = 0, n = packets_.size(); i < n; ++i) {
+        frameUniforms_->select(curSS_, packets_[i].drawIndex);
+        packets_[i].shape->draw(curSS_, packets_[i].lod);
+      }
+      packets_.clear();
+    }
+    if (!instances_.empty())
+      flushInstances();
+  }
+
   const ShaderState& getCurSS() const {
     return curSS_;
   }
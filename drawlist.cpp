@@ -0,0 +1,146 @@
+#include <cmath>
+#include <algorithm>
+#include <pthread.h>
+
+#include "drawlist.h"
+#include "arcball.h"
+#include "trace.h"
+
+using namespace std;
+
+DrawListBuilder::DrawListBuilder(const RigTFormf& initialRbt, const DrawListOptions& options, vector<DrawItem>& items)
+  : rbtStack_(1, initialRbt)
+  , options_(options)
+  , items_(items)
+  , skipDepth_(0) {}
+
+// The level of detail for a shape drawn with model view matrix MVM
+int DrawListBuilder::selectLod(SgShapeNode& shapeNode, const Matrix4f& MVM) {
+  if (options_.lodScreenHeight <= 0 || shapeNode.getNumLods() == 1)
+    return 0;
+
+  const Aabb box = shapeNode.getLocalBound().box;
+  const Cvec3 c = box.center();
+  const Cvec4f eyeCenter = MVM * Cvec4f(c[0], c[1], c[2], 1);
+  if (eyeCenter[2] > -CS175_EPS)
+    return 0; // at or behind the eye, where there is no screen scale
+
+  // the longest axis of the linear part bounds how much the radius grows
+  float maxScale2 = 0;
+  for (int j = 0; j < 3; ++j) {
+    maxScale2 = max(maxScale2, MVM(0,j) * MVM(0,j) + MVM(1,j) * MVM(1,j) + MVM(2,j) * MVM(2,j));
+  }
+  const double radius = norm(box.extent()) * 0.5 * sqrt(maxScale2);
+  return shapeNode.selectLod(radius / getScreenToEyeScale(eyeCenter[2], options_.lodFovY, options_.lodScreenHeight));
+}
+
+bool DrawListBuilder::visit(SgTransformNode& node) {
+  if (skipDepth_ > 0) {
+    ++skipDepth_;
+    return true;
+  }
+  rbtStack_.push_back(rbtStack_.back() * RigTFormf(node.getRbt()));
+  if (options_.culler && options_.culler->enter(node, rbtStack_.back()))
+    skipDepth_ = 1;
+  return true;
+}
+
+bool DrawListBuilder::postVisit(SgTransformNode& node) {
+  if (skipDepth_ > 1) {
+    --skipDepth_;
+    return true;
+  }
+  skipDepth_ = 0;
+  rbtStack_.pop_back();
+  return true;
+}
+
+bool DrawListBuilder::visit(SgShapeNode& shapeNode) {
+  if (skipDepth_ > 0)
+    return true;
+
+  items_.push_back(DrawItem());
+  DrawItem& item = items_.back();
+  item.shape = &shapeNode;
+
+  // The rigid part only rotates normals, so the normal matrix is its
+  // rotation times the shape's own normal matrix
+  Matrix4f rigid = rigTFormToMatrix(rbtStack_.back());
+  item.MVM = rigid * shapeNode.getAffineMatrixf();
+  rigid(0,3) = rigid(1,3) = rigid(2,3) = 0;
+  item.NMVM = rigid * shapeNode.getNormalMatrixf();
+  item.lod = selectLod(shapeNode, item.MVM);
+  item.instanceKey = options_.instancing ? shapeNode.getInstanceKey(item.lod) : NULL;
+  return true;
+}
+
+namespace {
+struct DrawListWorker {
+  SgTransformNode *root;
+  RigTFormf rootRbt;                       // eye frame of root
+  const DrawListOptions *options;
+  int firstChild, endChild;
+  vector<DrawItem> items;
+};
+}
+
+static void* drawListThread(void *arg) {
+  TRACE_SCOPE("drawListThread");
+  DrawListWorker& w = *static_cast<DrawListWorker*>(arg);
+  DrawListBuilder builder(w.rootRbt, *w.options, w.items);
+  for (int i = w.firstChild; i < w.endChild; ++i) {
+    w.root->getChild(i)->accept(builder);
+  }
+  return NULL;
+}
+
+void buildDrawList(SgTransformNode& root, const RigTForm& initialRbt, const DrawListOptions& options,
+                   vector<DrawItem>& items, int numThreads) {
+  TRACE_SCOPE("buildDrawList");
+  numThreads = min(numThreads, root.getNumChildren());
+  if (numThreads <= 1) {
+    DrawListBuilder builder(RigTFormf(initialRbt), options, items);
+    root.accept(builder);
+    return;
+  }
+
+  // the root itself, as the builders would see it
+  const RigTFormf rootRbt = RigTFormf(initialRbt) * RigTFormf(root.getRbt());
+  if (options.culler && options.culler->enter(root, rootRbt))
+    return;
+
+  // contiguous runs of children, so that concatenating the workers' lists
+  // keeps the traversal order
+  vector<DrawListWorker> workers(numThreads);
+  vector<pthread_t> threads(numThreads);
+  vector<bool> started(numThreads, false);
+  for (int i = 0; i < numThreads; ++i) {
+    DrawListWorker& w = workers[i];
+    w.root = &root;
+    w.rootRbt = rootRbt;
+    w.options = &options;
+    w.firstChild = root.getNumChildren() * i / numThreads;
+    w.endChild = root.getNumChildren() * (i + 1) / numThreads;
+    // the calling thread runs worker 0 itself
+    if (i > 0)
+      started[i] = pthread_create(&threads[i], NULL, drawListThread, &w) == 0;
+  }
+  // Also pick up the share of any worker whose thread could not be created
+  for (int i = 0; i < numThreads; ++i) {
+    if (!started[i])
+      drawListThread(&workers[i]);
+  }
+  for (int i = 1; i < numThreads; ++i) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+  }
+
+  size_t total = items.size();
+  for (int i = 0; i < numThreads; ++i) {
+    total += workers[i].items.size();
+  }
+  items.reserve(total);
+  for (int i = 0; i < numThreads; ++i) {
+    items.insert(items.end(), workers[i].items.begin(), workers[i].items.end());
+  }
+}
@@ -0,0 +1,58 @@
+#ifndef DRAWLIST_H
+#define DRAWLIST_H
+
+#include <vector>
+
+#include "scenegraph.h"
+#include "matrix4.h"
+#include "rigtform.h"
+#include "occlusionculler.h"
+
+// One shape to draw, with everything the GL thread needs to submit it
+struct DrawItem {
+  SgShapeNode *shape;
+  Matrix4f MVM, NMVM;
+  int lod;
+  const void *instanceKey;                 // NULL unless drawn instanced
+};
+
+struct DrawListOptions {
+  bool instancing;                         // look up instance keys
+  double lodFovY;
+  int lodScreenHeight;                     // 0 while levels of detail are off
+  OcclusionCuller *culler;                 // NULL if not culling
+
+  DrawListOptions()
+    : instancing(false), lodFovY(0), lodScreenHeight(0), culler(NULL) {}
+};
+
+// The CPU side of drawing the scene graph: composes the model view and
+// normal matrices of every shape, selects its level of detail, and skips
+// the subtrees the occlusion culler found hidden. Makes no GL calls, so
+// several can traverse disjoint subtrees at once.
+class DrawListBuilder : public SgNodeVisitor {
+  std::vector<RigTFormf> rbtStack_;
+  const DrawListOptions& options_;
+  std::vector<DrawItem>& items_;
+  int skipDepth_;                          // depth inside a skipped subtree, 0 if not in one
+
+  int selectLod(SgShapeNode& shapeNode, const Matrix4f& MVM);
+
+public:
+  // Appends to `items'. initialRbt is the eye frame of the parent of the
+  // first node visited. `options' is read as it is when visiting
+  DrawListBuilder(const RigTFormf& initialRbt, const DrawListOptions& options, std::vector<DrawItem>& items);
+
+  virtual bool visit(SgTransformNode& node);
+  virtual bool postVisit(SgTransformNode& node);
+  virtual bool visit(SgShapeNode& shapeNode);
+};
+
+// Same as visiting `root' with a DrawListBuilder, items coming out in
+// traversal order, but with the children of root split among `numThreads'
+// threads (the calling thread being one of them). Nothing may change the
+// scene graph meanwhile.
+void buildDrawList(SgTransformNode& root, const RigTForm& initialRbt, const DrawListOptions& options,
+                   std::vector<DrawItem>& items, int numThreads);
+
+#endif
@@ -0,0 +1,204 @@
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <algorithm>
+
+#include "frameprofiler.h"
+#include "timing.h"
+#include "asstcommon.h"
+
+using namespace std;
+
+enum {
+  FRAME_CPU_SERIES, FRAME_GPU_SERIES,
+  GL_CALLS_SERIES, DRAW_CALLS_SERIES, TRIANGLES_SERIES, UNIFORM_BYTES_SERIES, BUFFER_BINDS_SERIES,
+  FIRST_PHASE_SERIES
+};
+
+RollingHistogram::RollingHistogram(int minDecade, int numDecades)
+  : minDecade_(minDecade)
+  , samples_(WINDOW)
+  , buckets_(1 + numDecades * BUCKETS_PER_DECADE, 0)
+  , next_(0)
+  , count_(0)
+  , sum_(0) {}
+
+int RollingHistogram::bucketOf(double value) const {
+  if (value <= 0)
+    return 0;
+  const int b = int(floor((log10(value) - minDecade_) * BUCKETS_PER_DECADE));
+  return 1 + max(0, min(b, int(buckets_.size()) - 2));
+}
+
+void RollingHistogram::add(double ms) {
+  if (count_ == WINDOW) {
+    const double old = samples_[next_];
+    --buckets_[bucketOf(old)];
+    sum_ -= old;
+  }
+  else
+    ++count_;
+
+  samples_[next_] = ms;
+  ++buckets_[bucketOf(ms)];
+  sum_ += ms;
+  next_ = (next_ + 1) % WINDOW;
+}
+
+double RollingHistogram::getMax() const {
+  if (count_ == 0)
+    return 0;
+  return *max_element(samples_.begin(), samples_.begin() + count_);
+}
+
+double RollingHistogram::getPercentile(double p) const {
+  if (count_ == 0)
+    return 0;
+  const int rank = max(1, int(ceil(p / 100 * count_)));
+  int seen = 0, b = 0;
+  for (; b < int(buckets_.size()) - 1; ++b) {
+    seen += buckets_[b];
+    if (seen >= rank)
+      break;
+  }
+  if (b == 0)
+    return 0;
+  // the geometric middle of the bucket
+  const double value = pow(10.0, minDecade_ + (b - 0.5) / BUCKETS_PER_DECADE);
+  return min(value, getMax());
+}
+
+FrameProfiler::FrameProfiler()
+  : series_(FIRST_PHASE_SERIES)
+  , inFrame_(false)
+  , phase_(-1)
+  , frameStart_(0)
+  , phaseStart_(0)
+  , queryActive_(false)
+  , firstPending_(0)
+  , numPending_(0) {
+  static const char * const names[FIRST_PHASE_SERIES] = {
+    "frame_cpu", "frame_gpu", "gl_calls", "draw_calls", "triangles", "uniform_bytes", "buffer_binds"
+  };
+  for (int i = 0; i < FIRST_PHASE_SERIES; ++i) {
+    series_[i].name = names[i];
+    series_[i].isTime = i <= FRAME_GPU_SERIES;
+    series_[i].isGlCounter = !series_[i].isTime;
+    if (!series_[i].isTime)
+      series_[i].histogram = RollingHistogram(0, 10); // counts up to 10^10
+  }
+  frameStartCounters_ = g_glCounters;
+
+#ifndef __MAC__
+  gpu_ = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+#else
+  gpu_ = !g_Gl2Compatible;
+#endif
+  if (gpu_)
+    glGenQueries(NUM_QUERIES, queries_);
+}
+
+FrameProfiler::~FrameProfiler() {
+  if (gpu_)
+    glDeleteQueries(NUM_QUERIES, queries_);
+}
+
+void FrameProfiler::collectQueries() {
+  while (numPending_ > 0) {
+    const GLuint q = queries_[firstPending_];
+    GLint available = 0;
+    glGetQueryObjectiv(q, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+      return;
+    GLuint64 ns = 0;
+    glGetQueryObjectui64v(q, GL_QUERY_RESULT, &ns);
+    series_[FRAME_GPU_SERIES].histogram.add(ns * 1e-6);
+    firstPending_ = (firstPending_ + 1) % NUM_QUERIES;
+    --numPending_;
+  }
+}
+
+void FrameProfiler::beginFrame() {
+  if (gpu_)
+    collectQueries();
+
+  inFrame_ = true;
+  frameStart_ = getMonotonicSeconds();
+  frameStartCounters_ = g_glCounters;
+
+  // with every query still in flight this frame goes without a GPU time
+  queryActive_ = gpu_ && numPending_ < NUM_QUERIES;
+  if (queryActive_)
+    glBeginQuery(GL_TIME_ELAPSED, queries_[(firstPending_ + numPending_) % NUM_QUERIES]);
+}
+
+void FrameProfiler::endFrame() {
+  if (!inFrame_)
+    return;
+  endPhase();
+  if (queryActive_) {
+    glEndQuery(GL_TIME_ELAPSED);
+    ++numPending_;
+    queryActive_ = false;
+  }
+  series_[FRAME_CPU_SERIES].histogram.add((getMonotonicSeconds() - frameStart_) * 1000);
+  if (GL_COUNTERS_ENABLED) {
+    const GlCounters &c = g_glCounters, &s = frameStartCounters_;
+    series_[GL_CALLS_SERIES].histogram.add(c.calls - s.calls);
+    series_[DRAW_CALLS_SERIES].histogram.add(c.drawCalls - s.drawCalls);
+    series_[TRIANGLES_SERIES].histogram.add(c.triangles - s.triangles);
+    series_[UNIFORM_BYTES_SERIES].histogram.add(c.uniformBytes - s.uniformBytes);
+    series_[BUFFER_BINDS_SERIES].histogram.add(c.bufferBinds - s.bufferBinds);
+  }
+  inFrame_ = false;
+}
+
+int FrameProfiler::findSeries(const char *name, bool isTime) {
+  int i = FIRST_PHASE_SERIES;
+  while (i < series_.size() && strcmp(series_[i].name, name) != 0)
+    ++i;
+  if (i == series_.size()) {
+    series_.push_back(Series());
+    series_.back().name = name;
+    series_.back().isTime = isTime;
+    series_.back().isGlCounter = false;
+    if (!isTime)
+      series_.back().histogram = RollingHistogram(0, 10);
+  }
+  return i;
+}
+
+void FrameProfiler::beginPhase(const char *name) {
+  if (!inFrame_)
+    return;
+  endPhase();
+  phase_ = findSeries(name, true);
+  phaseStart_ = getMonotonicSeconds();
+}
+
+void FrameProfiler::addCount(const char *name, double value) {
+  if (inFrame_)
+    series_[findSeries(name, false)].histogram.add(value);
+}
+
+void FrameProfiler::endPhase() {
+  if (phase_ < 0)
+    return;
+  series_[phase_].histogram.add((getMonotonicSeconds() - phaseStart_) * 1000);
+  phase_ = -1;
+}
+
+void FrameProfiler::writeCsv(ostream& os) const {
+  const ios::fmtflags flags = os.flags();
+  os << "series,samples,mean,p50,p90,p99,max\n" << fixed << setprecision(4);
+  for (int i = 0; i < series_.size(); ++i) {
+    if (series_[i].isGlCounter && !GL_COUNTERS_ENABLED)
+      continue;
+    const RollingHistogram& h = series_[i].histogram;
+    os << series_[i].name << (series_[i].isTime ? "_ms," : ",") << h.getCount() << "," << h.getMean() << ","
+       << h.getPercentile(50) << "," << h.getPercentile(90) << "," << h.getPercentile(99) << ","
+       << h.getMax() << "\n";
+  }
+  os.flush();
+  os.flags(flags);
+}
@@ -0,0 +1,103 @@
+#ifndef FRAMEPROFILER_H
+#define FRAMEPROFILER_H
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "glsupport.h"
+#include "glcounters.h"
+
+// A histogram of the last WINDOW samples. Buckets are logarithmic with
+// BUCKETS_PER_DECADE per factor of ten from 10^minDecade to 10^(minDecade +
+// numDecades), plus one for zero, so percentiles come out within about 3% of
+// the exact value. The default range suits milliseconds from 1us to 10s.
+class RollingHistogram {
+public:
+  static const int WINDOW = 1024;
+  static const int BUCKETS_PER_DECADE = 40;
+
+  explicit RollingHistogram(int minDecade = -3, int numDecades = 7);
+
+  void add(double ms);
+
+  int getCount() const {
+    return count_;
+  }
+
+  double getMean() const {
+    return count_ ? sum_ / count_ : 0;
+  }
+
+  double getMax() const;
+
+  // The p-th percentile (p in [0, 100]) of the samples in the window
+  double getPercentile(double p) const;
+
+private:
+  int minDecade_;
+  std::vector<double> samples_;            // ring of the window
+  std::vector<int> buckets_;               // the zero bucket first
+  int next_, count_;
+  double sum_;
+
+  int bucketOf(double value) const;
+};
+
+// Times the frames drawn by display(): the CPU time of the whole frame and
+// of named phases inside it, and the GPU time of the frame through
+// GL_TIME_ELAPSED queries. Query results are only picked up once available,
+// a few frames later, so reading them never stalls the pipeline. With GL
+// counters compiled in (see glcounters.h) the GL traffic of each frame is
+// kept the same way.
+//
+// Phases do not nest, and are ignored outside of beginFrame/endFrame, so
+// code shared with picking can be instrumented unconditionally. The same goes
+// for counts, per frame figures such as the number of objects culled.
+class FrameProfiler : Noncopyable {
+public:
+  FrameProfiler();
+  ~FrameProfiler();
+
+  void beginFrame();
+  void endFrame();
+
+  // `name' must outlive the profiler, e.g. a string literal
+  void beginPhase(const char *name);
+  void endPhase();
+
+  // Adds the frame's value of the count series `name', which must outlive
+  // the profiler
+  void addCount(const char *name, double value);
+
+  // One line per series with its sample count, mean, p50, p90, p99 and max.
+  // Times are in milliseconds, and their series names end in _ms
+  void writeCsv(std::ostream& os) const;
+
+private:
+  static const int NUM_QUERIES = 4;        // frames of GPU latency tolerated before dropping samples
+
+  struct Series {
+    const char *name;
+    bool isTime;
+    bool isGlCounter;                      // only kept with GL counters compiled in
+    RollingHistogram histogram;
+  };
+
+  std::vector<Series> series_;             // the frame CPU and GPU times, GL counters, then phases and counts by first use
+  bool inFrame_;
+  int phase_;                              // open phase's series, or -1
+  double frameStart_, phaseStart_;
+
+  bool gpu_;                               // timer queries are supported
+  bool queryActive_;                       // for the current frame
+  GLuint queries_[NUM_QUERIES];
+  int firstPending_, numPending_;          // ring of queries still to be read
+
+  GlCounters frameStartCounters_;
+
+  void collectQueries();
+  int findSeries(const char *name, bool isTime);
+};
+
+#endif
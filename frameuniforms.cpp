@@ -0,0 +1,173 @@
+#include <algorithm>
+#include <cstring>
+
+#include "frameuniforms.h"
+
+using namespace std;
+using namespace std::tr1;
+
+static const int BYTES_PER_DRAW = FrameUniforms::FLOATS_PER_DRAW * sizeof(GLfloat);
+static const int BYTES_PER_BLOCK = FrameUniforms::DRAWS_PER_BLOCK * BYTES_PER_DRAW;
+
+FrameUniforms::FrameUniforms()
+  : persistent_(false)
+  , capacity_(0)
+  , count_(0)
+  , uploaded_(0)
+  , mapped_(NULL)
+  , region_(0)
+  , boundBlock_(-1) {
+#ifndef __MAC__
+  persistent_ = GLEW_ARB_buffer_storage;
+#endif
+  for (int i = 0; i < NUM_REGIONS; ++i) {
+    fences_[i] = 0;
+  }
+  allocate(8 * DRAWS_PER_BLOCK);
+}
+
+FrameUniforms::~FrameUniforms() {
+  clearFences();
+  if (mapped_) {
+    glBindBuffer(GL_UNIFORM_BUFFER, *ubo_);
+    glUnmapBuffer(GL_UNIFORM_BUFFER);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  }
+}
+
+void FrameUniforms::clearFences() {
+  for (int i = 0; i < NUM_REGIONS; ++i) {
+    if (fences_[i])
+      glDeleteSync(fences_[i]);
+    fences_[i] = 0;
+  }
+}
+
+// (Re)creates the buffer with room for `capacity' draws per frame, keeping the
+// draws already added this frame
+void FrameUniforms::allocate(int capacity) {
+  // whole blocks keep every glBindBufferRange offset a multiple of 16KB
+  capacity = (capacity + DRAWS_PER_BLOCK - 1) / DRAWS_PER_BLOCK * DRAWS_PER_BLOCK;
+
+  if (!persistent_) {
+    staging_.resize(capacity * FLOATS_PER_DRAW);
+    if (!ubo_)
+      ubo_.reset(new GlBufferObject());
+    glBindBuffer(GL_UNIFORM_BUFFER, *ubo_);
+    glBufferData(GL_UNIFORM_BUFFER, capacity * BYTES_PER_DRAW, NULL, GL_STREAM_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    uploaded_ = 0; // the new storage has none of this frame's draws
+  }
+#ifndef __MAC__
+  else {
+    // Buffer storage is immutable, so growing means a new buffer. Draws already
+    // issued keep using the old one until GL is done with it.
+    vector<GLfloat> keep(count_ * FLOATS_PER_DRAW);
+    if (count_)
+      memcpy(&keep[0], drawData(0), keep.size() * sizeof(GLfloat));
+    if (mapped_) {
+      glBindBuffer(GL_UNIFORM_BUFFER, *ubo_);
+      glUnmapBuffer(GL_UNIFORM_BUFFER);
+    }
+    clearFences();
+
+    ubo_.reset(new GlBufferObject());
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    const GLsizeiptr size = GLsizeiptr(capacity) * BYTES_PER_DRAW * NUM_REGIONS;
+    glBindBuffer(GL_UNIFORM_BUFFER, *ubo_);
+    glBufferStorage(GL_UNIFORM_BUFFER, size, NULL, flags);
+    mapped_ = static_cast<GLfloat*>(glMapBufferRange(GL_UNIFORM_BUFFER, 0, size, flags));
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    if (!mapped_)
+      throw runtime_error("FrameUniforms: cannot map uniform buffer");
+
+    capacity_ = capacity;
+    if (count_)
+      memcpy(drawData(0), &keep[0], keep.size() * sizeof(GLfloat));
+    uploaded_ = count_;
+  }
+#endif
+  capacity_ = capacity;
+  boundBlock_ = -1;
+  checkGlErrors();
+}
+
+GLfloat* FrameUniforms::drawData(int drawIndex) {
+  if (persistent_)
+    return mapped_ + (size_t(region_) * capacity_ + drawIndex) * FLOATS_PER_DRAW;
+  else
+    return &staging_[size_t(drawIndex) * FLOATS_PER_DRAW];
+}
+
+void FrameUniforms::beginFrame() {
+  count_ = uploaded_ = 0;
+  boundBlock_ = -1;
+
+  if (persistent_) {
+    region_ = (region_ + 1) % NUM_REGIONS;
+    // wait until the GPU is done with the frame that last used this region
+    if (fences_[region_]) {
+      while (glClientWaitSync(fences_[region_], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+        ;
+      glDeleteSync(fences_[region_]);
+      fences_[region_] = 0;
+    }
+  }
+  else {
+    // orphan last frame's storage so we never wait on draws still reading it
+    glBindBuffer(GL_UNIFORM_BUFFER, *ubo_);
+    glBufferData(GL_UNIFORM_BUFFER, capacity_ * BYTES_PER_DRAW, NULL, GL_STREAM_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  }
+}
+
+void FrameUniforms::endFrame() {
+  if (persistent_) {
+    if (fences_[region_])
+      glDeleteSync(fences_[region_]);
+    fences_[region_] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  }
+}
+
+int FrameUniforms::add(const Matrix4f& MVM, const Matrix4f& NMVM) {
+  if (count_ == capacity_)
+    allocate(capacity_ * 2);
+
+  GLfloat *d = drawData(count_);
+  memcpy(d, MVM.data(), 16 * sizeof(GLfloat));
+  memcpy(d + 16, NMVM.data(), 16 * sizeof(GLfloat));
+  return count_++;
+}
+
+void FrameUniforms::upload() {
+  if (uploaded_ == count_)
+    return;
+  if (persistent_) {
+    // coherent mapping: the writes are already visible
+    countGlUniform((count_ - uploaded_) * BYTES_PER_DRAW, 0);
+    uploaded_ = count_;
+    return;
+  }
+
+  glBindBuffer(GL_UNIFORM_BUFFER, *ubo_);
+  glBufferSubData(GL_UNIFORM_BUFFER, uploaded_ * BYTES_PER_DRAW,
+                  (count_ - uploaded_) * BYTES_PER_DRAW, drawData(uploaded_));
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  countGlBind();
+  countGlUniform((count_ - uploaded_) * BYTES_PER_DRAW);
+  uploaded_ = count_;
+}
+
+void FrameUniforms::select(const ShaderState& curSS, int drawIndex) {
+  assert(drawIndex < uploaded_ || persistent_);
+
+  const int block = drawIndex / DRAWS_PER_BLOCK;
+  if (block != boundBlock_) {
+    const int regionOffset = persistent_ ? region_ * capacity_ * BYTES_PER_DRAW : 0;
+    glBindBufferRange(GL_UNIFORM_BUFFER, PER_DRAW_UNIFORM_BINDING, *ubo_,
+                      regionOffset + block * BYTES_PER_BLOCK, BYTES_PER_BLOCK);
+    countGlBind();
+    boundBlock_ = block;
+  }
+  safe_glUniform1i(curSS.h_uDrawIndex, drawIndex - block * DRAWS_PER_BLOCK);
+}
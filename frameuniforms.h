@@ -0,0 +1,73 @@
+#ifndef FRAMEUNIFORMS_H
+#define FRAMEUNIFORMS_H
+
+#include <vector>
+#include <memory>
+#if __GNUG__
+#   include <tr1/memory>
+#endif
+
+#include "glsupport.h"
+#include "matrix4.h"
+#include "asstcommon.h"
+
+// Collects the model view and normal matrices of every draw in a frame into
+// one uniform buffer, read by shaders through the PerDraw block. A draw then
+// costs one glUniform1i for its index instead of two matrix uploads.
+//
+// The buffer is split into blocks of DRAWS_PER_BLOCK draws, the most a 16KB
+// uniform block can hold, and the block containing a draw is bound with
+// glBindBufferRange. Where ARB_buffer_storage is available the buffer is
+// persistently mapped with one region per frame in flight, and matrices are
+// written straight into it; otherwise they are staged and uploaded with
+// glBufferSubData into an orphaned buffer.
+class FrameUniforms : Noncopyable {
+public:
+  static const int DRAWS_PER_BLOCK = 128;  // must match MAX_DRAWS in basic-gl3.vshader
+  static const int FLOATS_PER_DRAW = 32;   // two column major mat4s
+
+  FrameUniforms();
+  ~FrameUniforms();
+
+  void beginFrame();
+  void endFrame();
+
+  // Stores the matrices of one draw, returning its index for select
+  int add(const Matrix4f& MVM, const Matrix4f& NMVM);
+
+  int add(const Matrix4& MVM, const Matrix4& NMVM) {
+    return add(Matrix4f(MVM), Matrix4f(NMVM));
+  }
+
+  // Makes everything added so far visible to the GPU
+  void upload();
+
+  // Points the shader's PerDraw block and uDrawIndex at draw `drawIndex'
+  void select(const ShaderState& curSS, int drawIndex);
+
+  // Shorthand for add, upload and select of a single draw
+  void sendModelViewNormalMatrix(const ShaderState& curSS, const Matrix4& MVM, const Matrix4& NMVM) {
+    const int i = add(MVM, NMVM);
+    upload();
+    select(curSS, i);
+  }
+
+private:
+  static const int NUM_REGIONS = 3;        // frames in flight when persistently mapped
+
+  std::tr1::shared_ptr<GlBufferObject> ubo_;
+  bool persistent_;
+  int capacity_;                           // draws per frame the buffer has room for
+  int count_, uploaded_;
+  std::vector<GLfloat> staging_;           // only without persistent mapping
+  GLfloat *mapped_;                        // start of all regions, if persistent
+  int region_;
+  GLsync fences_[NUM_REGIONS];
+  int boundBlock_;
+
+  GLfloat* drawData(int drawIndex);
+  void allocate(int capacity);
+  void clearFences();
+};
+
+#endif
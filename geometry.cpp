@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include "geometry.h"
+#include "meshopt.h"
+#include "timing.h"
+
+using namespace std;
+using namespace std::tr1;
+
+GeometryPage::GeometryPage(int vertexCapacity, int indexCapacity, GLenum indexType)
+  : indexType_(indexType)
+  , vertexCapacity_(vertexCapacity)
+  , indexCapacity_(indexCapacity)
+  , vertexCount_(0)
+  , indexCount_(0) {
+  // The IBO binding belongs to the bound VAO, which draws leave bound
+  glBindVertexArray(0);
+
+  glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(VertexPN) * vertexCapacity, NULL, GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo_);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, getIndexSize() * indexCapacity, NULL, GL_STATIC_DRAW);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void GeometryPage::add(const VertexPN *vtx, const void *idx, int vboLen, int iboLen,
+                       int& baseVertex, int& firstIndex) {
+  assert(fits(vboLen, iboLen));
+  baseVertex = vertexCount_;
+  firstIndex = indexCount_;
+
+  glBindVertexArray(0);
+
+  glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+  glBufferSubData(GL_ARRAY_BUFFER, sizeof(VertexPN) * baseVertex, sizeof(VertexPN) * vboLen, vtx);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo_);
+  glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, getIndexSize() * firstIndex, getIndexSize() * iboLen, idx);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+  vertexCount_ += vboLen;
+  indexCount_ += iboLen;
+}
+
+GeometryPage::VaoKey::VaoKey(const ShaderState& curSS, const InstanceBuffer *instances) {
+  v[0] = curSS.h_aPosition;
+  v[1] = curSS.h_aNormal;
+  v[2] = instances ? curSS.h_aModelViewMatrix : -1;
+  v[3] = instances ? curSS.h_aNormalMatrix : -1;
+  v[4] = instances ? curSS.h_aColor : -1;
+  v[5] = instances ? GLint(*instances) : 0;
+}
+
+void GeometryPage::bindVao(const ShaderState& curSS, const InstanceBuffer *instances) {
+  shared_ptr<GlArrayObject>& vao = vaos_[VaoKey(curSS, instances)];
+  countGlBind();
+  if (vao) {
+    glBindVertexArray(*vao);
+    return;
+  }
+
+  vao.reset(new GlArrayObject());
+  glBindVertexArray(*vao);
+
+  safe_glEnableVertexAttribArray(curSS.h_aPosition);
+  safe_glEnableVertexAttribArray(curSS.h_aNormal);
+  glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+  safe_glVertexAttribPointer(curSS.h_aPosition, 3, GL_FLOAT, GL_FALSE, sizeof(VertexPN), FIELD_OFFSET(VertexPN, p));
+  safe_glVertexAttribPointer(curSS.h_aNormal, 3, GL_FLOAT, GL_FALSE, sizeof(VertexPN), FIELD_OFFSET(VertexPN, n));
+
+  if (instances) {
+    // the instance buffer keeps its name when its storage is respecified,
+    // so pointing at it once is enough
+    glBindBuffer(GL_ARRAY_BUFFER, *instances);
+    enableInstanceAttribs(curSS, 0);
+  }
+
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo_);
+}
+
+GeometryArena::GeometryArena()
+  : shared_(hasBaseVertex()) {}
+
+shared_ptr<GeometryPage> GeometryArena::allocate(const VertexPN *vtx, const void *idx,
+                                                 int vboLen, int iboLen, GLenum indexType,
+                                                 int& baseVertex, int& firstIndex) {
+  shared_ptr<GeometryPage> page;
+  if (shared_) {
+    for (int i = 0; i < pages_.size() && !page; ++i) {
+      if (pages_[i]->getIndexType() == indexType && pages_[i]->fits(vboLen, iboLen))
+        page = pages_[i];
+    }
+    if (!page) {
+      page.reset(new GeometryPage(max(vboLen, int(PAGE_VERTICES)), max(iboLen, int(PAGE_INDICES)), indexType));
+      pages_.push_back(page);
+    }
+  }
+  else
+    page.reset(new GeometryPage(vboLen, iboLen, indexType));
+
+  page->add(vtx, idx, vboLen, iboLen, baseVertex, firstIndex);
+  return page;
+}
+
+Geometry::Geometry(GeometryArena& arena, const VertexPN *vtx, const unsigned short *idx, int vboLen, int iboLen)
+  : lods(NULL) {
+  vector<VertexPN> vertices(vtx, vtx + vboLen);
+  vector<unsigned int> indices(idx, idx + iboLen);
+  init(arena, vertices, indices);
+}
+
+Geometry::Geometry(GeometryArena& arena, const VertexPN *vtx, const unsigned int *idx, int vboLen, int iboLen)
+  : lods(NULL) {
+  vector<VertexPN> vertices(vtx, vtx + vboLen);
+  vector<unsigned int> indices(idx, idx + iboLen);
+  init(arena, vertices, indices);
+}
+
+void Geometry::init(GeometryArena& arena, vector<VertexPN>& vertices, vector<unsigned int>& indices) {
+  // the optimization and upload below need at least one triangle
+  if (indices.size() < 3)
+    throw runtime_error("Geometry: mesh has no triangles");
+
+  PhaseTimer& timer = getStartupTimer();
+  ostringstream name;
+  name << "geometry (" << vertices.size() << " vertices, " << indices.size() << " indices)";
+  ScopedPhase phase(timer, name.str());
+
+  timer.begin("optimize");
+  optimizeMesh(vertices, indices);
+  timer.end();
+  vboLen = vertices.size();
+  iboLen = indices.size();
+
+  for (int i = 0; i < vboLen; ++i) {
+    bound.box.add(Cvec3(vertices[i].p[0], vertices[i].p[1], vertices[i].p[2]));
+  }
+
+  ScopedPhase upload(timer, "upload");
+  if (vboLen <= 0x10000) {
+    vector<GLushort> shortIndices(indices.begin(), indices.end());
+    page = arena.allocate(&vertices[0], &shortIndices[0], vboLen, iboLen, GL_UNSIGNED_SHORT, baseVertex, firstIndex);
+  }
+  else
+    page = arena.allocate(&vertices[0], &indices[0], vboLen, iboLen, GL_UNSIGNED_INT, baseVertex, firstIndex);
+}
+
+void Geometry::draw(const ShaderState& curSS) {
+  page->bindVao(curSS, NULL);
+  countGlDraw(iboLen / 3);
+  if (hasBaseVertex())
+    glDrawElementsBaseVertex(GL_TRIANGLES, iboLen, page->getIndexType(), getIndexOffset(), baseVertex);
+  else
+    glDrawElements(GL_TRIANGLES, iboLen, page->getIndexType(), getIndexOffset()); // alone in its page
+}
+
+void Geometry::addInstancedDraw(InstancedDrawList& draws, int first, int count) const {
+  draws.add(*this, first, count);
+}
+
+int Geometry::getNumLods() const {
+  return lods ? lods->getNumLevels() : 1;
+}
+
+int Geometry::selectLod(double radiusPixels) const {
+  return lods ? lods->select(radiusPixels) : 0;
+}
+
+Geometry& Geometry::getLod(int level) {
+  return level == 0 ? *this : lods->getLevel(level);
+}
+
+void InstancedDrawList::add(const Geometry& geometry, int first, int count) {
+  Draw d;
+  d.page = geometry.page.get();
+  d.command.count = geometry.iboLen;
+  d.command.instanceCount = count;
+  d.command.firstIndex = geometry.firstIndex;
+  d.command.baseVertex = geometry.baseVertex;
+  d.command.baseInstance = first;
+  draws_.push_back(d);
+}
+
+void InstancedDrawList::submit(const ShaderState& curSS, InstanceBuffer& instances) {
+  // one run of draws per page
+  stable_sort(draws_.begin(), draws_.end());
+
+  const bool multiDraw = hasMultiDrawIndirect();
+  if (multiDraw) {
+    commands_.resize(draws_.size());
+    for (int i = 0, n = draws_.size(); i < n; ++i) {
+      commands_[i] = draws_[i].command;
+    }
+    instances.uploadCommands(&commands_[0], commands_.size());
+  }
+
+  for (int first = 0, n = draws_.size(); first < n;) {
+    int last = first + 1;
+    while (last < n && draws_[last].page == draws_[first].page)
+      ++last;
+
+    GeometryPage *page = draws_[first].page;
+    page->bindVao(curSS, &instances);
+#ifndef __MAC__
+    if (multiDraw) {
+      glMultiDrawElementsIndirect(GL_TRIANGLES, page->getIndexType(),
+                                  (GLvoid*)(sizeof(DrawElementsIndirectCommand) * first),
+                                  last - first, 0);
+      if (GL_COUNTERS_ENABLED) {
+        unsigned long triangles = 0;
+        for (int i = first; i < last; ++i) {
+          triangles += (unsigned long)(draws_[i].command.count / 3) * draws_[i].command.instanceCount;
+        }
+        countGlDraw(triangles);
+      }
+      first = last;
+      continue;
+    }
+#endif
+    for (int i = first; i < last; ++i) {
+      const DrawElementsIndirectCommand& c = draws_[i].command;
+      const GLvoid *indices = (GLvoid*)(size_t(page->getIndexSize()) * c.firstIndex);
+      countGlDraw((unsigned long)(c.count / 3) * c.instanceCount);
+#ifndef __MAC__
+      if (hasBaseInstance()) {
+        glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, c.count, page->getIndexType(), indices,
+                                                      c.instanceCount, c.baseVertex, c.baseInstance);
+        continue;
+      }
+#endif
+      // re-point the instance attributes, and back to what the cached VAO expects after
+      if (c.baseInstance) {
+        glBindBuffer(GL_ARRAY_BUFFER, instances);
+        countGlBind();
+        enableInstanceAttribs(curSS, sizeof(InstanceAttribs) * c.baseInstance);
+      }
+      glDrawElementsInstancedBaseVertex(GL_TRIANGLES, c.count, page->getIndexType(), indices,
+                                        c.instanceCount, c.baseVertex);
+      if (c.baseInstance)
+        enableInstanceAttribs(curSS, 0);
+    }
+    first = last;
+  }
+
+  if (multiDraw) {
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    countGlBind();
+  }
+  draws_.clear();
+}
@@ -0,0 +1,337 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#if __GNUG__
+#   include <tr1/memory>
+#endif
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "glsupport.h"
+#include "geometrymaker.h"
+#include "bounds.h"
+#include "asstcommon.h"
+
+// Macro used to obtain relative offset of a field within a struct
+#define FIELD_OFFSET(StructType, field) ((GLvoid*)offsetof(StructType, field))
+
+// A vertex with floating point position and normal
+struct VertexPN {
+  Cvec3f p, n;
+
+  VertexPN() {}
+  VertexPN(float x, float y, float z,
+           float nx, float ny, float nz)
+    : p(x,y,z), n(nx, ny, nz)
+  {}
+
+  // Define copy constructor and assignment operator from GenericVertex so we can
+  // use make* functions from geometrymaker.h
+  VertexPN(const GenericVertex& v) {
+    *this = v;
+  }
+
+  VertexPN& operator = (const GenericVertex& v) {
+    p = v.pos;
+    n = v.normal;
+    return *this;
+  }
+};
+
+// The per instance vertex attributes read by the instanced shaders
+struct InstanceAttribs {
+  GLfloat modelView[16];  // column major
+  GLfloat normal[9];      // upper 3x3 of the normal matrix, column major
+  GLfloat color[3];
+
+  void set(const Matrix4f& MVM, const Matrix4f& NMVM, const Cvec3& c) {
+    std::memcpy(modelView, MVM.data(), sizeof(modelView));
+    for (int col = 0; col < 3; ++col) {
+      std::memcpy(normal + col * 3, NMVM.data() + col * 4, 3 * sizeof(GLfloat));
+    }
+    color[0] = c[0];
+    color[1] = c[1];
+    color[2] = c[2];
+  }
+};
+
+// The layout glMultiDrawElementsIndirect reads its commands in
+struct DrawElementsIndirectCommand {
+  GLuint count;
+  GLuint instanceCount;
+  GLuint firstIndex;
+  GLint baseVertex;
+  GLuint baseInstance;
+};
+
+// Vertex buffer holding the instance attributes of a frame, and the buffer
+// of indirect draw commands reading them
+class InstanceBuffer : Noncopyable {
+  GlBufferObject vbo_, commands_;
+public:
+  // Replaces the contents. Respecifying the storage orphans the old one, so
+  // this never waits for draws still reading it.
+  void upload(const InstanceAttribs *attribs, int count) {
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(InstanceAttribs) * count, attribs, GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    countGlBind();
+    countGlCalls(2);
+  }
+
+  // Same for the commands, leaving them bound to GL_DRAW_INDIRECT_BUFFER
+  void uploadCommands(const DrawElementsIndirectCommand *commands, int count) {
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commands_);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawElementsIndirectCommand) * count, commands, GL_STREAM_DRAW);
+    countGlBind();
+    countGlCalls();
+  }
+
+  operator GLuint() const {
+    return vbo_;
+  }
+};
+
+// Points `columns' consecutive attribute slots starting at `handle' (a mat or
+// vec attribute) at one InstanceAttribs field, advancing once per instance
+inline void enableInstanceAttrib(const GLint handle, int columns, int size, size_t offset) {
+  if (handle < 0)
+    return;
+  for (int i = 0; i < columns; ++i) {
+    glEnableVertexAttribArray(handle + i);
+    glVertexAttribPointer(handle + i, size, GL_FLOAT, GL_FALSE, sizeof(InstanceAttribs),
+                          (GLvoid*)(offset + i * size * sizeof(GLfloat)));
+    glVertexAttribDivisor(handle + i, 1);
+  }
+  countGlCalls(3 * columns);
+}
+
+inline void enableInstanceAttribs(const ShaderState& curSS, size_t base) {
+  enableInstanceAttrib(curSS.h_aModelViewMatrix, 4, 4, base + offsetof(InstanceAttribs, modelView));
+  enableInstanceAttrib(curSS.h_aNormalMatrix, 3, 3, base + offsetof(InstanceAttribs, normal));
+  enableInstanceAttrib(curSS.h_aColor, 1, 3, base + offsetof(InstanceAttribs, color));
+}
+
+// Whether indices can be offset by a base vertex at draw time
+inline bool hasBaseVertex() {
+#ifndef __MAC__
+  static const bool has = GLEW_VERSION_3_2 || GLEW_ARB_draw_elements_base_vertex;
+  return has;
+#else
+  return true;
+#endif
+}
+
+// Whether instanced draws can start at an arbitrary instance without
+// respecifying the instance attribute pointers
+inline bool hasBaseInstance() {
+#ifndef __MAC__
+  static const bool has = GLEW_VERSION_4_2 || GLEW_ARB_base_instance;
+  return has;
+#else
+  return false;
+#endif
+}
+
+// Whether a list of instanced draws can be issued with one call
+inline bool hasMultiDrawIndirect() {
+#ifndef __MAC__
+  static const bool has = (GLEW_VERSION_4_3 || GLEW_ARB_multi_draw_indirect) && hasBaseInstance();
+  return has;
+#else
+  return false;
+#endif
+}
+
+// A pair of large vertex and index buffers holding many meshes, with the VAOs
+// that read them. Meshes index their own vertices and are drawn with a base
+// vertex, so all meshes of a page can be drawn without rebinding anything.
+//
+// A page holds either 16 or 32 bit indices.
+class GeometryPage : Noncopyable {
+public:
+  GeometryPage(int vertexCapacity, int indexCapacity, GLenum indexType);
+
+  GLenum getIndexType() const {
+    return indexType_;
+  }
+
+  int getIndexSize() const {
+    return indexType_ == GL_UNSIGNED_INT ? sizeof(GLuint) : sizeof(GLushort);
+  }
+
+  bool fits(int vboLen, int iboLen) const {
+    return vertexCount_ + vboLen <= vertexCapacity_ && indexCount_ + iboLen <= indexCapacity_;
+  }
+
+  // Copies a mesh in, returning where its vertices and indices start. The
+  // indices must be of the page's type.
+  void add(const VertexPN *vtx, const void *idx, int vboLen, int iboLen,
+           int& baseVertex, int& firstIndex);
+
+  // Binds the VAO for this shader layout, setting it up the first time
+  void bindVao(const ShaderState& curSS, const InstanceBuffer *instances);
+
+private:
+  // The attribute locations a VAO was set up for, plus the instance buffer
+  // for instanced shaders. Shaders agreeing on these share a VAO.
+  struct VaoKey {
+    GLint v[6];
+
+    VaoKey(const ShaderState& curSS, const InstanceBuffer *instances);
+
+    bool operator < (const VaoKey& o) const {
+      return std::lexicographical_compare(v, v + 6, o.v, o.v + 6);
+    }
+  };
+
+  GlBufferObject vbo_, ibo_;
+  GLenum indexType_;
+  int vertexCapacity_, indexCapacity_;
+  int vertexCount_, indexCount_;
+  std::map<VaoKey, std::tr1::shared_ptr<GlArrayObject> > vaos_;
+};
+
+// Sub-allocates static meshes from a few shared GeometryPages. Space is never
+// given back, so this is meant for meshes living as long as the program.
+// Without base vertex support every mesh gets a page of its own.
+class GeometryArena : Noncopyable {
+public:
+  static const int PAGE_VERTICES = 1 << 18;
+  static const int PAGE_INDICES = 1 << 20;
+
+  GeometryArena();
+
+  std::tr1::shared_ptr<GeometryPage> allocate(const VertexPN *vtx, const void *idx,
+                                              int vboLen, int iboLen, GLenum indexType,
+                                              int& baseVertex, int& firstIndex);
+
+private:
+  bool shared_;
+  std::vector<std::tr1::shared_ptr<GeometryPage> > pages_;
+};
+
+class InstancedDrawList;
+class LodChain;
+
+struct Geometry {
+  std::tr1::shared_ptr<GeometryPage> page;
+  int baseVertex, firstIndex;
+  int vboLen, iboLen;
+  ShapeBound bound; // box around the vertices; set kind to ELLIPSOID for spheres
+  const LodChain *lods; // set when registered as the finest level of a chain
+
+  // The mesh is optimized for the vertex cache and fetch order before upload,
+  // and stored with 16 bit indices if it has few enough vertices, else 32 bit
+  Geometry(GeometryArena& arena, const VertexPN *vtx, const unsigned short *idx, int vboLen, int iboLen);
+  Geometry(GeometryArena& arena, const VertexPN *vtx, const unsigned int *idx, int vboLen, int iboLen);
+
+  void draw(const ShaderState& curSS);
+  void addInstancedDraw(InstancedDrawList& draws, int first, int count) const;
+
+  int getNumLods() const;
+
+  // The level to draw when the bounding radius covers `radiusPixels' pixels
+  int selectLod(double radiusPixels) const;
+
+  // Level 0 is this geometry itself
+  Geometry& getLod(int level);
+
+  // Offset of the first index in the page's index buffer
+  const GLvoid* getIndexOffset() const {
+    return (const GLvoid*)(size_t(page->getIndexSize()) * firstIndex);
+  }
+
+private:
+  void init(GeometryArena& arena, std::vector<VertexPN>& vertices, std::vector<unsigned int>& indices);
+};
+
+// Tessellations of one shape at decreasing detail. Level i is drawn while the
+// shape's bounding radius covers at least getMinRadiusPixels(i) pixels, so the
+// thresholds decrease along the chain and the last one should be 0.
+class LodChain : Noncopyable {
+public:
+  void addLevel(std::tr1::shared_ptr<Geometry> geometry, double minRadiusPixels) {
+    assert(levels_.empty() || minRadiusPixels <= levels_.back().minRadiusPixels);
+    Level l;
+    l.geometry = geometry;
+    l.minRadiusPixels = minRadiusPixels;
+    levels_.push_back(l);
+  }
+
+  int getNumLevels() const {
+    return levels_.size();
+  }
+
+  Geometry& getLevel(int i) const {
+    return *levels_[i].geometry;
+  }
+
+  double getMinRadiusPixels(int i) const {
+    return levels_[i].minRadiusPixels;
+  }
+
+  int select(double radiusPixels) const {
+    int i = 0;
+    while (i + 1 < levels_.size() && radiusPixels < levels_[i].minRadiusPixels)
+      ++i;
+    return i;
+  }
+
+private:
+  struct Level {
+    std::tr1::shared_ptr<Geometry> geometry;
+    double minRadiusPixels;
+  };
+
+  std::vector<Level> levels_;
+};
+
+// Owns the LOD chains of all geometry drawn with levels of detail. Shapes keep
+// pointing at the finest level, and find the others through it.
+class LodRegistry : Noncopyable {
+public:
+  void add(std::tr1::shared_ptr<LodChain> chain) {
+    assert(chain->getNumLevels() > 0);
+    chains_.push_back(chain);
+    chain->getLevel(0).lods = chain.get();
+  }
+
+private:
+  std::vector<std::tr1::shared_ptr<LodChain> > chains_;
+};
+
+// Instanced draws of arena geometry collected over a frame. They are issued
+// by submit with one glMultiDrawElementsIndirect per page where available,
+// and one instanced draw each otherwise.
+class InstancedDrawList {
+public:
+  // Adds `count' instances of `geometry', the i-th one with the attributes at
+  // index first + i of the InstanceBuffer later given to submit
+  void add(const Geometry& geometry, int first, int count);
+
+  // Draws everything added so far with the instanced shader `curSS'
+  void submit(const ShaderState& curSS, InstanceBuffer& instances);
+
+private:
+  struct Draw {
+    GeometryPage *page;
+    DrawElementsIndirectCommand command;
+
+    bool operator < (const Draw& o) const {
+      return std::less<GeometryPage*>()(page, o.page);
+    }
+  };
+
+  std::vector<Draw> draws_;
+  std::vector<DrawElementsIndirectCommand> commands_;
+};
+
+#endif
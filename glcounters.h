@@ -0,0 +1,55 @@
+#ifndef GLCOUNTERS_H
+#define GLCOUNTERS_H
+
+// Counts of the GL traffic issued by the render path, to check that batching
+// and instancing actually reduce it. Kept only when CS175_GL_COUNTERS is
+// defined (make GLCOUNT=1); otherwise the count functions do nothing and
+// compile away.
+//
+// The safe_gl wrappers and the direct calls made while drawing a frame are
+// counted; one-off setup such as creating buffers or textures is not.
+struct GlCounters {
+  unsigned long calls;          // every counted GL call, including the ones below
+  unsigned long drawCalls;
+  unsigned long triangles;      // submitted, times instances
+  unsigned long uniformBytes;   // through glUniform*, uniform buffers and light buffers
+  unsigned long bufferBinds;    // buffer, vertex array and buffer range binds
+};
+
+#ifdef CS175_GL_COUNTERS
+static const bool GL_COUNTERS_ENABLED = true;
+#else
+static const bool GL_COUNTERS_ENABLED = false;
+#endif
+
+extern GlCounters g_glCounters;
+
+inline void countGlCalls(unsigned long n = 1) {
+  if (GL_COUNTERS_ENABLED)
+    g_glCounters.calls += n;
+}
+
+inline void countGlDraw(unsigned long triangles) {
+  if (GL_COUNTERS_ENABLED) {
+    ++g_glCounters.calls;
+    ++g_glCounters.drawCalls;
+    g_glCounters.triangles += triangles;
+  }
+}
+
+// `calls' is 0 for data written straight into mapped uniform buffers
+inline void countGlUniform(unsigned long bytes, unsigned long calls = 1) {
+  if (GL_COUNTERS_ENABLED) {
+    g_glCounters.calls += calls;
+    g_glCounters.uniformBytes += bytes;
+  }
+}
+
+inline void countGlBind() {
+  if (GL_COUNTERS_ENABLED) {
+    ++g_glCounters.calls;
+    ++g_glCounters.bufferBinds;
+  }
+}
+
+#endif
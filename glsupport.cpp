@@ -8,6 +8,8 @@
 
 using namespace std;
 
+GlCounters g_glCounters = {0, 0, 0, 0, 0};
+
 void checkGlErrors() {
   const GLenum errCode = glGetError();
 
@@ -19,8 +21,7 @@ void checkGlErrors() {
   }
 }
 
-// Dump text file into a character vector, throws exception on error
-static void readTextFile(const char *fn, vector<char>& data) {
+void readTextFile(const char *fn, vector<char>& data) {
   // Sets ios::binary bit to prevent end of line translation, so that the
   // number of bytes we read equals file size
   ifstream ifs(fn, ios::binary);
@@ -69,6 +70,10 @@ static void compileShader(GLuint shaderHandle, int sourceLength, const char *sou
 
   glCompileShader(shaderHandle);
 
+  checkShaderCompiled(shaderHandle, filenameHint);
+}
+
+void checkShaderCompiled(GLuint shaderHandle, const char *filenameHint) {
   printShaderInfoLog(shaderHandle, filenameHint);
 
   GLint compiled = 0;
@@ -97,6 +102,10 @@ void linkShader(GLuint programHandle, GLuint vs, GLuint fs) {
   glDetachShader(programHandle, vs);
   glDetachShader(programHandle, fs);
 
+  checkProgramLinked(programHandle);
+}
+
+void checkProgramLinked(GLuint programHandle) {
   GLint linked = 0;
   glGetProgramiv(programHandle, GL_LINK_STATUS, &linked);
   printProgramInfoLog(programHandle, "linking");
@@ -2,6 +2,7 @@
 #define GLSUPPORT_H
 
 #include <iostream>
+#include <vector>
 #include <stdexcept>
 
 #ifdef __MAC__
@@ -12,6 +13,8 @@
 #   include <GL/glut.h>
 #endif
 
+#include "glcounters.h"
+
 // Check if there has been an error inside OpenGL and if yes, print the error and
 // through a runtime_error exception.
 void checkGlErrors();
@@ -30,6 +33,16 @@ void readAndCompileShaderFromMemory(GLuint programHandle,
 // Link two compiled vertex shader and fragment shader into a GL shader program
 void linkShader(GLuint programHandle, GLuint vertexShaderHandle, GLuint fragmentShaderHandle);
 
+// Prints the info log of a shader that was compiled with glCompileShader, and
+// throws runtime_error if the compilation failed
+void checkShaderCompiled(GLuint shaderHandle, const char *filenameHint);
+
+// Same for a program linked with glLinkProgram
+void checkProgramLinked(GLuint programHandle);
+
+// Dumps a text file into a character vector. Throws runtime_error on error
+void readTextFile(const char *fn, std::vector<char>& data);
+
 // Reads and compiles a single shader (vertex, fragment, etc) file into a GL
 // shader. Throws runtime_error on error
 void readAndCompileSingleShader(GLuint shaderHandle, const char* shaderFileName);
@@ -166,6 +179,50 @@ public:
   }
 };
 
+// Light wrapper around a GL framebuffer object handle that automatically allocates
+// and deallocates. Can be casted to a GLuint.
+class GlFramebufferObject : Noncopyable {
+protected:
+  GLuint handle_;
+
+public:
+  GlFramebufferObject() {
+    glGenFramebuffers(1, &handle_);
+    checkGlErrors();
+  }
+
+  ~GlFramebufferObject() {
+    glDeleteFramebuffers(1, &handle_);
+  }
+
+  // Casts to GLuint so can be used directly glBindFramebuffer and so on
+  operator GLuint() const {
+    return handle_;
+  }
+};
+
+// Light wrapper around a GL renderbuffer object handle that automatically allocates
+// and deallocates. Can be casted to a GLuint.
+class GlRenderbufferObject : Noncopyable {
+protected:
+  GLuint handle_;
+
+public:
+  GlRenderbufferObject() {
+    glGenRenderbuffers(1, &handle_);
+    checkGlErrors();
+  }
+
+  ~GlRenderbufferObject() {
+    glDeleteRenderbuffers(1, &handle_);
+  }
+
+  // Casts to GLuint so can be used directly glBindRenderbuffer and so on
+  operator GLuint() const {
+    return handle_;
+  }
+};
+
 // Safe versions of various functions that handle GLSL shader attributes
 // and variables: These mainly issue a warning when specified attributes
 // and variables do not exist in the compiled GLSL program (e.g., due to
@@ -187,88 +244,129 @@ inline GLint safe_glGetAttribLocation(const GLuint program, const char varname[]
 }
 
 inline void safe_glUniformMatrix4fv(const GLint handle, const GLfloat data[]) {
-  if (handle >= 0)
+  if (handle >= 0) {
     glUniformMatrix4fv(handle, 1, GL_FALSE, data);
+    countGlUniform(16 * sizeof(GLfloat));
+  }
 }
 
 inline void safe_glUniform1i(const GLint handle, const GLint a) {
-  if (handle >= 0)
+  if (handle >= 0) {
     glUniform1i(handle, a);
+    countGlUniform(sizeof(GLint));
+  }
 }
 
 inline void safe_glUniform2i(const GLint handle, const GLint a, const GLint b) {
-  if (handle >= 0)
+  if (handle >= 0) {
     glUniform2i(handle, a, b);
+    countGlUniform(2 * sizeof(GLint));
+  }
 }
 
 inline void safe_glUniform3i(const GLint handle, const GLint a, const GLint b, const GLint c) {
-  if (handle >= 0)
+  if (handle >= 0) {
     glUniform3i(handle, a, b, c);
+    countGlUniform(3 * sizeof(GLint));
+  }
 }
 
 inline void safe_glUniform4i(const GLint handle, const GLint a, const GLint b, const GLint c, const GLint d) {
-  if (handle >= 0)
+  if (handle >= 0) {
     glUniform4i(handle, a, b, c, d);
+    countGlUniform(4 * sizeof(GLint));
+  }
+}
+
+inline void safe_glUniform1ui(const GLint handle, const GLuint a) {
+  if (handle >= 0) {
+    glUniform1ui(handle, a);
+    countGlUniform(sizeof(GLuint));
+  }
 }
 
 inline void safe_glUniform1f(const GLint handle, const GLfloat a) {
-  if (handle >= 0)
+  if (handle >= 0) {
     glUniform1f(handle, a);
+    countGlUniform(sizeof(GLfloat));
+  }
 }
 
 inline void safe_glUniform2f(const GLint handle, const GLfloat a, const GLfloat b) {
-  if (handle >= 0)
+  if (handle >= 0) {
     glUniform2f(handle, a, b);
+    countGlUniform(2 * sizeof(GLfloat));
+  }
 }
 
 inline void safe_glUniform3f(const GLint handle, const GLfloat a, const GLfloat b, const GLfloat c) {
-  if (handle >= 0)
+  if (handle >= 0) {
     glUniform3f(handle, a, b, c);
+    countGlUniform(3 * sizeof(GLfloat));
+  }
 }
 
 inline void safe_glUniform4f(const GLint handle, const GLfloat a, const GLfloat b, const GLfloat c, const GLfloat d) {
-  if (handle >= 0)
+  if (handle >= 0) {
     glUniform4f(handle, a, b, c, d);
+    countGlUniform(4 * sizeof(GLfloat));
+  }
 }
 
 inline void safe_glEnableVertexAttribArray(const GLint handle) {
-  if (handle >= 0)
+  if (handle >= 0) {
     glEnableVertexAttribArray(handle);
+    countGlCalls();
+  }
 }
 
 inline void safe_glDisableVertexAttribArray(const GLint handle) {
-  if (handle >= 0)
+  if (handle >= 0) {
     glDisableVertexAttribArray(handle);
+    countGlCalls();
+  }
 }
 
 inline void safe_glVertexAttribPointer(const GLint handle, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const GLvoid *pointer) {
-  if (handle >= 0)
+  if (handle >= 0) {
     glVertexAttribPointer(handle, size, type, normalized, stride, pointer);
+    countGlCalls();
+  }
 }
 
 inline void safe_glVertexAttrib1f(const GLint handle, const GLfloat a) {
-  if (handle >= 0)
+  if (handle >= 0) {
     glVertexAttrib1f(handle, a);
+    countGlCalls();
+  }
 }
 
 inline void safe_glVertexAttrib2f(const GLint handle, const GLfloat a, const GLfloat b) {
-  if (handle >= 0)
+  if (handle >= 0) {
     glVertexAttrib2f(handle, a, b);
+    countGlCalls();
+  }
 }
 
 inline void safe_glVertexAttrib3f(const GLint handle, const GLfloat a, const GLfloat b, const GLfloat c) {
-  if (handle >= 0)
+  if (handle >= 0) {
     glVertexAttrib3f(handle, a, b, c);
+    countGlCalls();
+  }
 }
 
 inline void safe_glVertexAttrib4f(const GLint handle, const GLfloat a, const GLfloat b, const GLfloat c, const GLfloat d) {
-  if (handle >= 0)
+  if (handle >= 0) {
     glVertexAttrib4f(handle, a, b, c, d);
+    countGlCalls();
+  }
 }
 
 inline void safe_glVertexAttrib4Nub(const GLint handle, const GLubyte a, const GLubyte b, const GLubyte c, const GLubyte d) {
-  if (handle >= 0)
+  if (handle >= 0) {
     glVertexAttrib4Nub(handle, a, b, c, d);
+    countGlCalls();
+  }
 }
 
 
@@ -0,0 +1,149 @@
+#include <cmath>
+#include <algorithm>
+
+#include "lightclusters.h"
+#include "glcounters.h"
+
+using namespace std;
+
+static const int NUM_CLUSTERS = LightClusters::CLUSTERS_X * LightClusters::CLUSTERS_Y * LightClusters::CLUSTERS_Z;
+
+static int clampCluster(double c, int n) {
+  return max(0, min(int(floor(c)), n - 1));
+}
+
+LightClusters::LightClusters()
+  : numIndices_(0)
+  , tileWidth_(1)
+  , tileHeight_(1)
+  , zScale_(0)
+  , zBias_(0) {}
+
+void LightClusters::build(const vector<PointLight>& lights, const RigTForm& invEyeRbt, const Matrix4& projection,
+                          double frustNear, double frustFar, int width, int height) {
+  const double nearDepth = -frustNear, farDepth = -frustFar;
+  tileWidth_ = GLfloat(width) / CLUSTERS_X;
+  tileHeight_ = GLfloat(height) / CLUSTERS_Y;
+  // slice = log(depth / near) / log(far / near) * CLUSTERS_Z
+  zScale_ = CLUSTERS_Z / log(farDepth / nearDepth);
+  zBias_ = -log(nearDepth) * zScale_;
+
+  const int n = lights.size();
+  lightData_.resize(max(1, n) * 8);
+  ranges_.resize(n * 6);
+
+  // the range of clusters each light's sphere overlaps, conservatively
+  for (int i = 0; i < n; ++i) {
+    const Cvec3 p = Cvec3(invEyeRbt * Cvec4(lights[i].position, 1));
+    const double r = lights[i].radius;
+    GLfloat *d = &lightData_[i * 8];
+    for (int j = 0; j < 3; ++j) {
+      d[j] = p[j];
+      d[4 + j] = lights[i].color[j];
+    }
+    d[3] = r;
+    d[7] = 0;
+
+    // every cluster unless narrowed down below
+    int *range = &ranges_[i * 6];
+    const int all[6] = {0, CLUSTERS_X - 1, 0, CLUSTERS_Y - 1, 0, CLUSTERS_Z - 1};
+    copy(all, all + 6, range);
+    if (r <= 0)
+      continue;
+
+    const double zMin = -p[2] - r, zMax = -p[2] + r;
+    if (zMax < nearDepth || zMin > farDepth) {
+      range[1] = -1; // touches nothing
+      continue;
+    }
+    range[4] = clampCluster(log(max(zMin, nearDepth)) * zScale_ + zBias_, CLUSTERS_Z);
+    range[5] = clampCluster(log(min(zMax, farDepth)) * zScale_ + zBias_, CLUSTERS_Z);
+
+    // a sphere crossing the near plane may cover any tile; otherwise the
+    // corners of its bounding box, all in front of the eye, bound its projection
+    if (zMin <= nearDepth)
+      continue;
+    double x0 = 1, x1 = -1, y0 = 1, y1 = -1;
+    for (int c = 0; c < 8; ++c) {
+      const Cvec4 clip = projection * Cvec4(p[0] + (c & 1 ? r : -r), p[1] + (c & 2 ? r : -r), p[2] + (c & 4 ? r : -r), 1);
+      x0 = min(x0, clip[0] / clip[3]);
+      x1 = max(x1, clip[0] / clip[3]);
+      y0 = min(y0, clip[1] / clip[3]);
+      y1 = max(y1, clip[1] / clip[3]);
+    }
+    if (x1 < -1 || x0 > 1 || y1 < -1 || y0 > 1) {
+      range[1] = -1;
+      continue;
+    }
+    range[0] = clampCluster((x0 + 1) / 2 * CLUSTERS_X, CLUSTERS_X);
+    range[1] = clampCluster((x1 + 1) / 2 * CLUSTERS_X, CLUSTERS_X);
+    range[2] = clampCluster((y0 + 1) / 2 * CLUSTERS_Y, CLUSTERS_Y);
+    range[3] = clampCluster((y1 + 1) / 2 * CLUSTERS_Y, CLUSTERS_Y);
+  }
+
+  // count the lights of each cluster, turn the counts into offsets, then fill
+  gridData_.assign(NUM_CLUSTERS * 2, 0);
+  for (int i = 0; i < n; ++i) {
+    const int *range = &ranges_[i * 6];
+    for (int z = range[4]; z <= range[5]; ++z)
+      for (int y = range[2]; y <= range[3]; ++y)
+        for (int x = range[0]; x <= range[1]; ++x)
+          ++gridData_[((z * CLUSTERS_Y + y) * CLUSTERS_X + x) * 2 + 1];
+  }
+  numIndices_ = 0;
+  for (int c = 0; c < NUM_CLUSTERS; ++c) {
+    gridData_[c * 2] = numIndices_;
+    numIndices_ += gridData_[c * 2 + 1];
+    gridData_[c * 2 + 1] = 0;
+  }
+  indexData_.resize(max(1, numIndices_));
+  for (int i = 0; i < n; ++i) {
+    const int *range = &ranges_[i * 6];
+    for (int z = range[4]; z <= range[5]; ++z)
+      for (int y = range[2]; y <= range[3]; ++y)
+        for (int x = range[0]; x <= range[1]; ++x) {
+          GLuint *cluster = &gridData_[((z * CLUSTERS_Y + y) * CLUSTERS_X + x) * 2];
+          indexData_[cluster[0] + cluster[1]++] = i;
+        }
+  }
+
+  upload(lights_, GL_RGBA32F, lightData_);
+  upload(grid_, GL_RG32UI, gridData_);
+  upload(indices_, GL_R32UI, indexData_);
+  checkGlErrors();
+}
+
+// Orphans the buffer's storage and refills it, so that draws of the previous
+// frame still reading it never stall the upload
+template<typename T>
+void LightClusters::upload(Buffer& buffer, GLenum format, vector<T>& data) {
+  glBindBuffer(GL_TEXTURE_BUFFER, buffer.bo);
+  glBufferData(GL_TEXTURE_BUFFER, data.size() * sizeof(T), &data[0], GL_STREAM_DRAW);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+  glBindTexture(GL_TEXTURE_BUFFER, buffer.tex);
+  glTexBuffer(GL_TEXTURE_BUFFER, format, buffer.bo);
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
+  countGlBind();
+  countGlUniform(data.size() * sizeof(T), 0);
+  countGlCalls(5);
+}
+
+void LightClusters::bind(const ShaderState& curSS) const {
+  if (curSS.h_uLightData < 0)
+    return;
+
+  const Buffer *buffers[] = {&lights_, &grid_, &indices_};
+  for (int i = 0; i < 3; ++i) {
+    glActiveTexture(GL_TEXTURE0 + LIGHT_TEXTURE_UNIT + i);
+    glBindTexture(GL_TEXTURE_BUFFER, buffers[i]->tex);
+  }
+  glActiveTexture(GL_TEXTURE0);
+  countGlCalls(7);
+
+  safe_glUniform1i(curSS.h_uLightData, LIGHT_TEXTURE_UNIT);
+  safe_glUniform1i(curSS.h_uLightClusters, LIGHT_TEXTURE_UNIT + 1);
+  safe_glUniform1i(curSS.h_uLightIndices, LIGHT_TEXTURE_UNIT + 2);
+  safe_glUniform2f(curSS.h_uClusterTileSize, tileWidth_, tileHeight_);
+  safe_glUniform2f(curSS.h_uClusterZ, zScale_, zBias_);
+  safe_glUniform3i(curSS.h_uClusterDims, CLUSTERS_X, CLUSTERS_Y, CLUSTERS_Z);
+}
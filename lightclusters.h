@@ -0,0 +1,72 @@
+#ifndef LIGHTCLUSTERS_H
+#define LIGHTCLUSTERS_H
+
+#include <vector>
+
+#include "glsupport.h"
+#include "cvec.h"
+#include "matrix4.h"
+#include "rigtform.h"
+#include "asstcommon.h"
+
+// A point light in world space. Its contribution falls off smoothly to zero
+// at `radius'; a radius of zero means it reaches everywhere, unattenuated.
+struct PointLight {
+  Cvec3 position;
+  Cvec3 color;
+  double radius;
+
+  PointLight(const Cvec3& p, const Cvec3& c, double r = 0)
+    : position(p), color(c), radius(r) {}
+};
+
+// Clustered forward lighting. The view frustum is cut into a grid of
+// CLUSTERS_X by CLUSTERS_Y screen tiles and CLUSTERS_Z depth slices, spaced
+// exponentially between the near and far planes. Every frame, build finds the
+// clusters each light's sphere may touch and stores, per cluster, the list of
+// those lights. A fragment then only evaluates the lights of its own cluster,
+// so shading cost follows the local light density rather than the total.
+//
+// The lights, the per cluster (first index, count) pairs and the index lists
+// are each kept in a texture buffer, read by surface-gl3.fshader through
+// texelFetch. Texture buffers are core since GL 3.1, so this is GL3 only.
+class LightClusters : Noncopyable {
+public:
+  static const int CLUSTERS_X = 16, CLUSTERS_Y = 9, CLUSTERS_Z = 24;
+
+  LightClusters();
+
+  // Assigns `lights' to clusters for the given view. frustNear and frustFar
+  // are the z coordinates of the clipping planes, negative as for
+  // Matrix4::makeProjection
+  void build(const std::vector<PointLight>& lights, const RigTForm& invEyeRbt, const Matrix4& projection,
+             double frustNear, double frustFar, int width, int height);
+
+  // Binds the light textures and points the shader's uniforms at them.
+  // Shaders without the uniforms are left alone
+  void bind(const ShaderState& curSS) const;
+
+  // Light indices stored in the last build, over all clusters
+  int getNumIndices() const {
+    return numIndices_;
+  }
+
+private:
+  struct Buffer {
+    GlBufferObject bo;
+    GlTexture tex;
+  };
+
+  Buffer lights_, grid_, indices_;
+  std::vector<GLfloat> lightData_;         // two RGBA texels per light: position and radius, color
+  std::vector<GLuint> gridData_;           // (first index, count) per cluster
+  std::vector<GLuint> indexData_;
+  std::vector<int> ranges_;                // clusters touched by each light: x0, x1, y0, y1, z0, z1
+  int numIndices_;
+  GLfloat tileWidth_, tileHeight_, zScale_, zBias_;
+
+  template<typename T>
+  void upload(Buffer& buffer, GLenum format, std::vector<T>& data);
+};
+
+#endif
@@ -296,5 +296,108 @@ inline Matrix4 linFact(const Matrix4& m) {
 }
 
 
+// A single precision 4x4 matrix for the render path. Unlike Matrix4 it is
+// stored column-major, the layout OpenGL wants, so data() can be handed to
+// glUniformMatrix4fv or copied into a buffer as is.
+class Matrix4f {
+  CS175_ALIGN16 float d_[16]; // layout is column-major
+
+public:
+  float &operator () (const int row, const int col) {
+    return d_[(col << 2) + row];
+  }
+
+  const float &operator () (const int row, const int col) const {
+    return d_[(col << 2) + row];
+  }
+
+  const float* data() const {
+    return d_;
+  }
+
+  Matrix4f() {
+    for (int i = 0; i < 16; ++i) {
+      d_[i] = 0;
+    }
+    for (int i = 0; i < 4; ++i) {
+      (*this)(i,i) = 1;
+    }
+  }
+
+  explicit Matrix4f(const float a) {
+    for (int i = 0; i < 16; ++i) {
+      d_[i] = a;
+    }
+  }
+
+  explicit Matrix4f(const Matrix4& m) {
+    for (int i = 0; i < 4; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        (*this)(i,j) = float(m(i,j));
+      }
+    }
+  }
+
+  Matrix4 toMatrix4() const {
+    Matrix4 m;
+    for (int i = 0; i < 4; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        m(i,j) = (*this)(i,j);
+      }
+    }
+    return m;
+  }
+
+  Matrix4f operator * (const Matrix4f& m) const {
+    // column j of the product is a sum of our columns weighted by column j
+    // of m; the inner loop runs over contiguous floats and vectorizes
+    Matrix4f r(0.f);
+    for (int j = 0; j < 4; ++j) {
+      for (int k = 0; k < 4; ++k) {
+        const float b = m.d_[(j << 2) + k];
+        for (int i = 0; i < 4; ++i) {
+          r.d_[(j << 2) + i] += d_[(k << 2) + i] * b;
+        }
+      }
+    }
+    return r;
+  }
+
+  Cvec4f operator * (const Cvec4f& v) const {
+    Cvec4f r(0);
+    for (int j = 0; j < 4; ++j) {
+      for (int i = 0; i < 4; ++i) {
+        r[i] += (*this)(i,j) * v[j];
+      }
+    }
+    return r;
+  }
+};
+
+// The normal matrix of an affine matrix: the inverse transpose of its linear
+// part, computed from the 3x3 cofactors
+inline Matrix4f normalMatrix(const Matrix4f& m) {
+  Matrix4f r;
+  r(0,0) = m(1,1) * m(2,2) - m(1,2) * m(2,1);
+  r(0,1) = m(1,2) * m(2,0) - m(1,0) * m(2,2);
+  r(0,2) = m(1,0) * m(2,1) - m(1,1) * m(2,0);
+  r(1,0) = m(0,2) * m(2,1) - m(0,1) * m(2,2);
+  r(1,1) = m(0,0) * m(2,2) - m(0,2) * m(2,0);
+  r(1,2) = m(0,1) * m(2,0) - m(0,0) * m(2,1);
+  r(2,0) = m(0,1) * m(1,2) - m(0,2) * m(1,1);
+  r(2,1) = m(0,2) * m(1,0) - m(0,0) * m(1,2);
+  r(2,2) = m(0,0) * m(1,1) - m(0,1) * m(1,0);
+
+  const float det = m(0,0) * r(0,0) + m(0,1) * r(0,1) + m(0,2) * r(0,2);
+  assert(std::abs(det) > CS175_EPS3);
+  const float invDet = 1 / det;
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      r(i,j) *= invDet;
+    }
+  }
+  return r;
+}
+
 #endif
 
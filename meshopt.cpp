@@ -0,0 +1,161 @@
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+
+#include "meshopt.h"
+
+using namespace std;
+
+// Parameters from Forsyth's "Linear-Speed Vertex Cache Optimisation"
+static const int CACHE_SIZE = 32;
+static const float CACHE_DECAY_POWER = 1.5f;
+static const float LAST_TRI_SCORE = 0.75f;
+static const float VALENCE_BOOST_SCALE = 2.0f;
+static const float VALENCE_BOOST_POWER = 0.5f;
+
+namespace {
+struct VertexInfo {
+  int cachePos;        // -1 when not in the cache
+  int remainingTris;   // not yet emitted triangles using the vertex
+  int firstTri;        // into the triangle adjacency list
+  float score;
+};
+}
+
+static float vertexScore(const VertexInfo& v) {
+  if (v.remainingTris == 0)
+    return -1;
+
+  float score = 0;
+  if (v.cachePos >= 0) {
+    // the three vertices of the last triangle get a fixed score, so that
+    // strip-like orders are not preferred over fans
+    if (v.cachePos < 3)
+      score = LAST_TRI_SCORE;
+    else
+      score = pow(1 - float(v.cachePos - 3) / (CACHE_SIZE - 3), CACHE_DECAY_POWER);
+  }
+
+  // vertices with few triangles left are worth finishing off
+  return score + VALENCE_BOOST_SCALE * pow(float(v.remainingTris), -VALENCE_BOOST_POWER);
+}
+
+void optimizeVertexCache(vector<unsigned int>& indices, int numVertices) {
+  const int numTris = indices.size() / 3;
+  if (numTris < 2)
+    return;
+
+  vector<VertexInfo> verts(numVertices);
+  for (int i = 0; i < numVertices; ++i) {
+    verts[i].cachePos = -1;
+    verts[i].remainingTris = 0;
+  }
+  for (int i = 0; i < numTris * 3; ++i) {
+    assert(indices[i] < numVertices);
+    ++verts[indices[i]].remainingTris;
+  }
+
+  // triangles using each vertex, packed back to back; the live ones of a
+  // vertex are the first remainingTris of its range
+  vector<int> vertTris(numTris * 3);
+  for (int i = 0, offset = 0; i < numVertices; ++i) {
+    verts[i].firstTri = offset;
+    offset += verts[i].remainingTris;
+    verts[i].remainingTris = 0;
+  }
+  for (int t = 0; t < numTris; ++t) {
+    for (int k = 0; k < 3; ++k) {
+      VertexInfo& v = verts[indices[3*t + k]];
+      vertTris[v.firstTri + v.remainingTris++] = t;
+    }
+  }
+
+  for (int i = 0; i < numVertices; ++i) {
+    verts[i].score = vertexScore(verts[i]);
+  }
+  vector<float> triScores(numTris);
+  for (int t = 0; t < numTris; ++t) {
+    triScores[t] = verts[indices[3*t]].score + verts[indices[3*t+1]].score + verts[indices[3*t+2]].score;
+  }
+
+  vector<bool> emitted(numTris, false);
+  vector<unsigned int> result;
+  result.reserve(numTris * 3);
+
+  // the extra slots hold vertices pushed out by the last triangle
+  int cache[CACHE_SIZE + 3];
+  int cacheLen = 0;
+
+  int bestTri = 0;
+  int nextUnemitted = 0; // where to resume the linear search if the cache runs dry
+  for (int emittedCount = 0; emittedCount < numTris; ++emittedCount) {
+    if (bestTri < 0) {
+      while (emitted[nextUnemitted])
+        ++nextUnemitted;
+      bestTri = nextUnemitted;
+    }
+
+    emitted[bestTri] = true;
+    int newCache[CACHE_SIZE + 3];
+    int newLen = 0;
+    for (int k = 0; k < 3; ++k) {
+      const int vi = indices[3*bestTri + k];
+      result.push_back(vi);
+      newCache[newLen++] = vi;
+
+      // drop the triangle from the vertex's live triangles
+      VertexInfo& v = verts[vi];
+      int *tris = &vertTris[v.firstTri];
+      int *pos = find(tris, tris + v.remainingTris, bestTri);
+      assert(pos != tris + v.remainingTris);
+      swap(*pos, tris[--v.remainingTris]);
+    }
+    for (int i = 0; i < cacheLen; ++i) {
+      const int vi = cache[i];
+      if (vi != newCache[0] && vi != newCache[1] && vi != newCache[2])
+        newCache[newLen++] = vi;
+    }
+
+    // rescore everything that was or is in the cache, and the triangles of
+    // the vertices still in it
+    for (int i = 0; i < newLen; ++i) {
+      VertexInfo& v = verts[newCache[i]];
+      v.cachePos = i < CACHE_SIZE ? i : -1;
+      const float old = v.score;
+      v.score = vertexScore(v);
+      const float delta = v.score - old;
+      for (int j = 0; j < v.remainingTris; ++j) {
+        triScores[vertTris[v.firstTri + j]] += delta;
+      }
+    }
+
+    bestTri = -1;
+    float bestScore = -1;
+    cacheLen = min(newLen, CACHE_SIZE);
+    for (int i = 0; i < cacheLen; ++i) {
+      cache[i] = newCache[i];
+      const VertexInfo& v = verts[cache[i]];
+      for (int j = 0; j < v.remainingTris; ++j) {
+        const int t = vertTris[v.firstTri + j];
+        if (triScores[t] > bestScore) {
+          bestScore = triScores[t];
+          bestTri = t;
+        }
+      }
+    }
+  }
+
+  indices.swap(result);
+}
+
+int optimizeVertexFetch(vector<unsigned int>& indices, int numVertices, vector<int>& remap) {
+  remap.assign(numVertices, -1);
+  int next = 0;
+  for (int i = 0; i < indices.size(); ++i) {
+    int& r = remap[indices[i]];
+    if (r < 0)
+      r = next++;
+    indices[i] = r;
+  }
+  return next;
+}
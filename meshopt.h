@@ -0,0 +1,32 @@
+#ifndef MESHOPT_H
+#define MESHOPT_H
+
+#include <vector>
+
+// Reorders the triangles of an indexed triangle list so that consecutive
+// triangles reuse recently transformed vertices, using Tom Forsyth's linear
+// speed vertex cache optimization. Only the order of the triangles changes.
+void optimizeVertexCache(std::vector<unsigned int>& indices, int numVertices);
+
+// Computes a vertex order following first use by `indices', and rewrites the
+// indices for it. On return remap[i] is the new position of vertex i, or -1
+// for vertices no triangle uses, and the number of used vertices is returned.
+int optimizeVertexFetch(std::vector<unsigned int>& indices, int numVertices, std::vector<int>& remap);
+
+// Runs both passes over a mesh, moving its vertices to match and dropping
+// unused ones. The cache pass goes first since the fetch order follows it.
+template<typename Vertex>
+void optimizeMesh(std::vector<Vertex>& vertices, std::vector<unsigned int>& indices) {
+  optimizeVertexCache(indices, vertices.size());
+
+  std::vector<int> remap;
+  const int numUsed = optimizeVertexFetch(indices, vertices.size(), remap);
+  std::vector<Vertex> reordered(numUsed);
+  for (int i = 0; i < vertices.size(); ++i) {
+    if (remap[i] >= 0)
+      reordered[remap[i]] = vertices[i];
+  }
+  vertices.swap(reordered);
+}
+
+#endif
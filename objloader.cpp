@@ -0,0 +1,429 @@
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "objloader.h"
+#include "timing.h"
+
+using namespace std;
+using namespace std::tr1;
+
+// Relative (negative) OBJ indices are stored as their chunk-local index minus
+// this bias, which keeps them apart from absolute ones (>= 0) until the
+// chunk offsets are known
+static const int RELATIVE_BIAS = 1 << 30;
+
+namespace {
+// What one chunk of the file contributes
+struct ObjChunk {
+  const char *begin, *end;
+  vector<float> positions;   // xyz
+  vector<float> normals;     // xyz
+  vector<int> corners;       // position and normal index of each triangle corner, -1 for no normal
+  string error;
+};
+
+// Maps a file for reading, unmapping it when destroyed
+class ObjMappedFile {
+  void *map_;
+  size_t len_;
+
+  ObjMappedFile(const ObjMappedFile&);
+  const ObjMappedFile& operator= (const ObjMappedFile&);
+
+public:
+  explicit ObjMappedFile(const char *filename) : map_(NULL), len_(0) {
+    const int fd = ::open(filename, O_RDONLY);
+    if (fd < 0)
+      throw runtime_error(string("objRead: Cannot open file ") + filename + " for read");
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw runtime_error(string("objRead: Cannot stat file ") + filename);
+    }
+    len_ = st.st_size;
+    if (len_ == 0) {
+      ::close(fd);
+      return;
+    }
+
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    void *m = mmap(NULL, len_, PROT_READ, flags, fd, 0);
+    ::close(fd);
+    if (m == MAP_FAILED)
+      throw runtime_error(string("objRead: Cannot map file ") + filename);
+    map_ = m;
+  }
+
+  ~ObjMappedFile() {
+    if (map_)
+      munmap(map_, len_);
+  }
+
+  const char* begin() const {
+    return static_cast<const char*>(map_);
+  }
+
+  const char* end() const {
+    return begin() + len_;
+  }
+};
+}
+
+static inline bool objIsSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline void objSkipSpaces(const char *&p, const char *end) {
+  while (p < end && objIsSpace(*p))
+    ++p;
+}
+
+static inline void objSkipLine(const char *&p, const char *end) {
+  const char *nl = static_cast<const char*>(memchr(p, '\n', end - p));
+  p = nl ? nl + 1 : end;
+}
+
+// Parses a decimal number with optional sign, fraction and exponent
+static bool objParseFloat(const char *&p, const char *end, float& out) {
+  static const double POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+    1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+  };
+
+  objSkipSpaces(p, end);
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = *p++ == '-';
+
+  // up to 18 significant digits fit an integer mantissa exactly
+  unsigned long long mantissa = 0;
+  int digits = 0, exponent = 0;
+  bool any = false;
+  for (; p < end && *p >= '0' && *p <= '9'; ++p, any = true) {
+    if (digits < 18) {
+      mantissa = mantissa * 10 + (*p - '0');
+      if (mantissa)
+        ++digits;
+    }
+    else
+      ++exponent;
+  }
+  if (p < end && *p == '.') {
+    for (++p; p < end && *p >= '0' && *p <= '9'; ++p, any = true) {
+      if (digits < 18) {
+        mantissa = mantissa * 10 + (*p - '0');
+        if (mantissa)
+          ++digits;
+        --exponent;
+      }
+    }
+  }
+  if (!any)
+    return false;
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    ++p;
+    bool negExp = false;
+    if (p < end && (*p == '-' || *p == '+'))
+      negExp = *p++ == '-';
+    int e = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+      e = min(e * 10 + (*p - '0'), 10000);
+    }
+    exponent += negExp ? -e : e;
+  }
+
+  double v = double(mantissa);
+  if (exponent < 0)
+    v = exponent >= -18 ? v / POW10[-exponent] : v * pow(10.0, exponent);
+  else if (exponent > 0)
+    v = exponent <= 18 ? v * POW10[exponent] : v * pow(10.0, exponent);
+  out = float(negative ? -v : v);
+  return true;
+}
+
+static bool objParseInt(const char *&p, const char *end, int& out) {
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = *p++ == '-';
+  if (p == end || *p < '0' || *p > '9')
+    return false;
+  int v = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+    v = v * 10 + (*p - '0');
+  }
+  out = negative ? -v : v;
+  return true;
+}
+
+// Turns an OBJ index (1 based, or negative for relative to the `count'
+// elements read so far in this chunk) into our encoding
+static int objEncodeIndex(int i, int count) {
+  if (i > 0)
+    return i - 1;
+  return count + i - RELATIVE_BIAS;
+}
+
+static int objDecodeIndex(int i, int chunkOffset) {
+  return i >= 0 ? i : i + RELATIVE_BIAS + chunkOffset;
+}
+
+static void objParseChunk(ObjChunk& c) {
+  const char *p = c.begin, *end = c.end;
+  vector<int> face; // corners of the current polygon, as position/normal pairs
+
+  while (p < end) {
+    objSkipSpaces(p, end);
+    if (p == end)
+      break;
+
+    if (p + 1 < end && p[0] == 'v' && objIsSpace(p[1])) {
+      p += 2;
+      float x, y, z;
+      if (!objParseFloat(p, end, x) || !objParseFloat(p, end, y) || !objParseFloat(p, end, z))
+        throw runtime_error("bad vertex position");
+      c.positions.push_back(x);
+      c.positions.push_back(y);
+      c.positions.push_back(z);
+    }
+    else if (p + 2 < end && p[0] == 'v' && p[1] == 'n' && objIsSpace(p[2])) {
+      p += 3;
+      float x, y, z;
+      if (!objParseFloat(p, end, x) || !objParseFloat(p, end, y) || !objParseFloat(p, end, z))
+        throw runtime_error("bad vertex normal");
+      c.normals.push_back(x);
+      c.normals.push_back(y);
+      c.normals.push_back(z);
+    }
+    else if (p + 1 < end && p[0] == 'f' && objIsSpace(p[1])) {
+      p += 2;
+      face.clear();
+      const int numPositions = c.positions.size() / 3, numNormals = c.normals.size() / 3;
+      for (;;) {
+        objSkipSpaces(p, end);
+        if (p == end || *p == '\n' || *p == '#')
+          break;
+
+        // v, v/vt, v//vn or v/vt/vn
+        int v, vt, vn = 0;
+        if (!objParseInt(p, end, v) || v == 0)
+          throw runtime_error("bad face");
+        if (p < end && *p == '/') {
+          ++p;
+          if (p < end && *p != '/' && !objParseInt(p, end, vt))
+            throw runtime_error("bad face");
+          if (p < end && *p == '/') {
+            ++p;
+            if (!objParseInt(p, end, vn) || vn == 0)
+              throw runtime_error("bad face");
+          }
+        }
+        face.push_back(objEncodeIndex(v, numPositions));
+        face.push_back(vn ? objEncodeIndex(vn, numNormals) : -1);
+      }
+      if (face.size() < 6)
+        throw runtime_error("face with fewer than 3 vertices");
+
+      // a fan around the first corner
+      for (int i = 2; i + 3 < face.size(); i += 2) {
+        c.corners.push_back(face[0]);
+        c.corners.push_back(face[1]);
+        c.corners.push_back(face[i]);
+        c.corners.push_back(face[i+1]);
+        c.corners.push_back(face[i+2]);
+        c.corners.push_back(face[i+3]);
+      }
+    }
+    objSkipLine(p, end);
+  }
+}
+
+static void *objChunkThread(void *arg) {
+  ObjChunk &c = *static_cast<ObjChunk*>(arg);
+  try {
+    objParseChunk(c);
+  }
+  catch (const exception& e) {
+    c.error = e.what();
+  }
+  return NULL;
+}
+
+// An open addressing hash table from position/normal pairs to vertex indices.
+// It never grows, so it must be given a bound on the number of keys inserted
+static const unsigned long long OBJ_EMPTY_KEY = ~0ULL;
+
+namespace {
+class ObjVertexTable {
+  vector<unsigned long long> keys_;
+  vector<unsigned int> values_;
+  size_t mask_;
+
+public:
+  explicit ObjVertexTable(size_t expected) {
+    size_t capacity = 16;
+    while (capacity < expected * 2)
+      capacity <<= 1;
+    keys_.assign(capacity, OBJ_EMPTY_KEY);
+    values_.resize(capacity);
+    mask_ = capacity - 1;
+  }
+
+  // Returns the value stored for key, inserting `value' if there is none
+  unsigned int findOrInsert(unsigned long long key, unsigned int value) {
+    size_t i = size_t((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask_;
+    while (keys_[i] != OBJ_EMPTY_KEY) {
+      if (keys_[i] == key)
+        return values_[i];
+      i = (i + 1) & mask_;
+    }
+    keys_[i] = key;
+    values_[i] = value;
+    return value;
+  }
+};
+}
+
+void objRead(const char *filename, vector<VertexPN>& vertices,
+             vector<unsigned int>& indices, int numThreads) {
+  vertices.clear();
+  indices.clear();
+
+  ObjMappedFile file(filename);
+  const char *begin = file.begin(), *end = file.end();
+  if (begin == end)
+    return;
+
+  if (numThreads <= 0)
+    numThreads = max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+  // no point splitting small files
+  numThreads = max(1, min<int>(numThreads, (end - begin) / (1 << 16)));
+
+  // Chunks end right after a newline, so no record straddles two of them
+  vector<ObjChunk> chunks(numThreads);
+  const char *p = begin;
+  for (int i = 0; i < numThreads; ++i) {
+    chunks[i].begin = p;
+    if (i + 1 < numThreads) {
+      const char *split = max(p, begin + (end - begin) / numThreads * (i + 1));
+      objSkipLine(split, end);
+      p = split;
+    }
+    else
+      p = end;
+    chunks[i].end = p;
+  }
+
+  PhaseTimer& timer = getStartupTimer();
+  timer.begin("parse");
+  vector<pthread_t> threads(numThreads);
+  vector<bool> started(numThreads, false);
+  for (int i = 1; i < numThreads; ++i) {
+    started[i] = pthread_create(&threads[i], NULL, objChunkThread, &chunks[i]) == 0;
+  }
+  // the calling thread parses the first chunk, and any whose thread could not be created
+  for (int i = 0; i < numThreads; ++i) {
+    if (!started[i])
+      objChunkThread(&chunks[i]);
+  }
+  for (int i = 1; i < numThreads; ++i) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+  }
+  timer.end();
+  for (int i = 0; i < numThreads; ++i) {
+    if (!chunks[i].error.empty())
+      throw runtime_error(string("objRead: ") + filename + ": " + chunks[i].error);
+  }
+
+  // Gather the positions and normals in file order
+  ScopedPhase merge(timer, "merge");
+  vector<float> positions, normals;
+  vector<int> positionOffsets(numThreads), normalOffsets(numThreads);
+  size_t numCorners = 0;
+  for (int i = 0; i < numThreads; ++i) {
+    positionOffsets[i] = positions.size() / 3;
+    normalOffsets[i] = normals.size() / 3;
+    positions.insert(positions.end(), chunks[i].positions.begin(), chunks[i].positions.end());
+    normals.insert(normals.end(), chunks[i].normals.begin(), chunks[i].normals.end());
+    numCorners += chunks[i].corners.size() / 2;
+    vector<float>().swap(chunks[i].positions);
+    vector<float>().swap(chunks[i].normals);
+  }
+  const int numPositions = positions.size() / 3, numNormals = normals.size() / 3;
+
+  // Make one vertex per distinct position/normal pair. Every corner of a
+  // faceted mesh may have its own normal, so only the corners bound the pairs
+  ObjVertexTable table(numCorners);
+  vector<int> vertexPosition; // for the vertices needing a computed normal
+  bool missingNormals = false;
+  indices.reserve(numCorners);
+  for (int i = 0; i < numThreads; ++i) {
+    const vector<int>& corners = chunks[i].corners;
+    for (size_t j = 0; j < corners.size(); j += 2) {
+      const int v = objDecodeIndex(corners[j], positionOffsets[i]);
+      const int vn = corners[j+1] == -1 ? -1 : objDecodeIndex(corners[j+1], normalOffsets[i]);
+      if (v < 0 || v >= numPositions || vn < -1 || vn >= numNormals)
+        throw runtime_error(string("objRead: ") + filename + ": index out of range");
+
+      const unsigned long long key = (unsigned long long)(v) << 32 | (unsigned int)(vn + 1);
+      const unsigned int index = table.findOrInsert(key, vertices.size());
+      if (index == vertices.size()) {
+        const float *pos = &positions[3*v];
+        if (vn >= 0) {
+          const float *n = &normals[3*vn];
+          vertices.push_back(VertexPN(pos[0], pos[1], pos[2], n[0], n[1], n[2]));
+        }
+        else {
+          vertices.push_back(VertexPN(pos[0], pos[1], pos[2], 0, 0, 0));
+          missingNormals = true;
+        }
+        vertexPosition.push_back(vn >= 0 ? -1 : v);
+      }
+      indices.push_back(index);
+    }
+  }
+
+  // Area weighted averages of the faces around each position
+  if (missingNormals) {
+    vector<Cvec3f> smooth(numPositions, Cvec3f(0));
+    for (size_t t = 0; t + 2 < indices.size(); t += 3) {
+      const Cvec3f &a = vertices[indices[t]].p, &b = vertices[indices[t+1]].p, &c = vertices[indices[t+2]].p;
+      const Cvec3f n = cross(b - a, c - a);
+      for (int k = 0; k < 3; ++k) {
+        const unsigned int vi = indices[t+k];
+        if (vertexPosition[vi] >= 0)
+          smooth[vertexPosition[vi]] += n;
+      }
+    }
+    for (size_t i = 0; i < vertices.size(); ++i) {
+      if (vertexPosition[i] >= 0) {
+        const Cvec3f& n = smooth[vertexPosition[i]];
+        const float len2 = dot(n, n);
+        vertices[i].n = len2 > 0 ? n / sqrt(len2) : Cvec3f(0, 1, 0);
+      }
+    }
+  }
+}
+
+shared_ptr<Geometry> objLoadGeometry(GeometryArena& arena, const char *filename, int numThreads) {
+  vector<VertexPN> vertices;
+  vector<unsigned int> indices;
+  objRead(filename, vertices, indices, numThreads);
+  if (indices.empty())
+    throw runtime_error(string("objRead: ") + filename + ": no faces");
+  return shared_ptr<Geometry>(new Geometry(arena, &vertices[0], &indices[0], vertices.size(), indices.size()));
+}
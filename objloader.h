@@ -0,0 +1,28 @@
+#ifndef OBJLOADER_H
+#define OBJLOADER_H
+
+#include <vector>
+#include <memory>
+#if __GNUG__
+#   include <tr1/memory>
+#endif
+
+#include "geometry.h"
+
+// Reads the triangles of a Wavefront OBJ file, from its v, vn and f records
+// (polygons are split into fans; everything else is skipped). The file is
+// memory-mapped and split into numThreads chunks parsed in parallel, with
+// numThreads <= 0 meaning one per processor. Numbers are parsed by hand, so
+// the result does not depend on the C locale.
+//
+// Every distinct position/normal pair becomes one vertex. Faces without
+// normals get smooth ones averaged from the faces around their positions.
+// Throws an exception on error.
+void objRead(const char *filename, std::vector<VertexPN>& vertices,
+             std::vector<unsigned int>& indices, int numThreads = 0);
+
+// Shorthand for objRead followed by creating a Geometry from the result
+std::tr1::shared_ptr<Geometry> objLoadGeometry(GeometryArena& arena, const char *filename,
+                                               int numThreads = 0);
+
+#endif
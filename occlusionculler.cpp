@@ -0,0 +1,188 @@
+#include <cstring>
+
+#include "occlusionculler.h"
+#include "geometry.h"
+#include "glcounters.h"
+
+using namespace std;
+using namespace std::tr1;
+
+namespace {
+// Bounds a subtree in the frame of its root, leaving out the root's own rbt
+class SubtreeBounder : public SgNodeVisitor {
+  vector<RigTForm> rbtStack_;
+
+public:
+  Aabb box;
+
+  virtual bool visit(SgTransformNode& node) {
+    rbtStack_.push_back(rbtStack_.empty() ? RigTForm() : rbtStack_.back() * node.getRbt());
+    return true;
+  }
+
+  virtual bool postVisit(SgTransformNode& node) {
+    rbtStack_.pop_back();
+    return true;
+  }
+
+  virtual bool visit(SgShapeNode& node) {
+    box.add(transformAabb(rigTFormToMatrix(rbtStack_.back()) * node.getAffineMatrix(), node.getLocalBound().box));
+    return true;
+  }
+};
+}
+
+OcclusionCuller::OcclusionCuller()
+  : frame_(0)
+  , boundsGeneration_(0)
+  , boundsValid_(false)
+  , queriedProjection_(0)
+  , numQueries_(0) {
+#ifndef __MAC__
+  queryTarget_ = GLEW_VERSION_3_3 ? GL_ANY_SAMPLES_PASSED : GL_SAMPLES_PASSED;
+#else
+  queryTarget_ = g_Gl2Compatible ? GL_SAMPLES_PASSED : GL_ANY_SAMPLES_PASSED;
+#endif
+}
+
+OcclusionCuller::~OcclusionCuller() {
+  for (int i = 0; i < candidates_.size(); ++i) {
+    glDeleteQueries(1, &candidates_[i].query);
+  }
+}
+
+void OcclusionCuller::addCandidate(shared_ptr<SgTransformNode> node) {
+  if (indices_.count(node.get()))
+    return;
+  Candidate c;
+  c.node = node;
+  glGenQueries(1, &c.query);
+  c.pending = c.occluded = c.culled = c.queried = false;
+  c.visitedFrame = 0;
+  c.queriedGeneration = 0;
+  indices_[node.get()] = candidates_.size();
+  candidates_.push_back(c);
+  boundsValid_ = false;
+}
+
+void OcclusionCuller::reset() {
+  for (int i = 0; i < candidates_.size(); ++i) {
+    Candidate& c = candidates_[i];
+    c.pending = c.occluded = c.culled = c.queried = false;
+  }
+}
+
+void OcclusionCuller::updateBounds() {
+  for (int i = 0; i < candidates_.size(); ++i) {
+    SubtreeBounder bounder;
+    candidates_[i].node->accept(bounder);
+    candidates_[i].box = bounder.box;
+  }
+  boundsGeneration_ = getSceneGeneration();
+  boundsValid_ = true;
+}
+
+void OcclusionCuller::beginFrame() {
+  ++frame_;
+  numQueries_ = 0;
+  if (!boundsValid_ || boundsGeneration_ != getSceneGeneration())
+    updateBounds();
+
+  for (int i = 0; i < candidates_.size(); ++i) {
+    Candidate& c = candidates_[i];
+    if (!c.pending)
+      continue;
+    GLint available = 0;
+    glGetQueryObjectiv(c.query, GL_QUERY_RESULT_AVAILABLE, &available);
+    countGlCalls();
+    if (!available)
+      continue;
+    GLuint samples = 0;
+    glGetQueryObjectuiv(c.query, GL_QUERY_RESULT, &samples);
+    countGlCalls();
+    c.occluded = samples == 0;
+    c.pending = false;
+  }
+}
+
+bool OcclusionCuller::enter(Candidate& c, const RigTFormf& eyeRbt) {
+  c.visitedFrame = frame_;
+  c.eyeMatrix = rigTFormToMatrix(eyeRbt);
+  c.culled = c.occluded;
+  return c.culled;
+}
+
+void OcclusionCuller::issueQueries(const ShaderState& curSS, Geometry& box, const Matrix4& projection, double frustNear) {
+  bool projectionChanged = false;
+  for (int i = 0; i < 4; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      projectionChanged |= projection(i,j) != queriedProjection_(i,j);
+    }
+  }
+  queriedProjection_ = projection;
+  const unsigned long generation = getSceneGeneration();
+
+  bool began = false;
+  for (int i = 0; i < candidates_.size(); ++i) {
+    Candidate& c = candidates_[i];
+    if (c.visitedFrame != frame_ || c.pending)
+      continue;
+    if (c.queried && !projectionChanged && c.queriedGeneration == generation &&
+        memcmp(c.queriedEyeMatrix.data(), c.eyeMatrix.data(), 16 * sizeof(float)) == 0)
+      continue; // the last result still holds
+
+    c.queried = true;
+    c.queriedGeneration = generation;
+    c.queriedEyeMatrix = c.eyeMatrix;
+
+    // a box reaching the near plane may hide its own samples from the query
+    bool nearEye = c.box.isEmpty();
+    for (int k = 0; k < 8 && !nearEye; ++k) {
+      const Cvec4f p = c.eyeMatrix * Cvec4f(k & 1 ? c.box.hi[0] : c.box.lo[0],
+                                            k & 2 ? c.box.hi[1] : c.box.lo[1],
+                                            k & 4 ? c.box.hi[2] : c.box.lo[2], 1);
+      nearEye = p[2] > frustNear;
+    }
+    if (nearEye) {
+      c.occluded = false;
+      continue;
+    }
+
+    if (!began) {
+      glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+      glDepthMask(GL_FALSE);
+      countGlCalls(2);
+      began = true;
+    }
+    const Matrix4f boxMatrix = c.eyeMatrix * Matrix4f(Matrix4::makeTranslation(c.box.center()) *
+                                                      Matrix4::makeScale(c.box.extent()));
+    sendModelViewNormalMatrix(curSS, boxMatrix, boxMatrix);
+    glBeginQuery(queryTarget_, c.query);
+    box.draw(curSS);
+    glEndQuery(queryTarget_);
+    countGlCalls(2);
+    c.pending = true;
+    ++numQueries_;
+  }
+  if (began) {
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthMask(GL_TRUE);
+    countGlCalls(2);
+  }
+}
+
+int OcclusionCuller::getNumCulled() const {
+  int n = 0;
+  for (int i = 0; i < candidates_.size(); ++i) {
+    n += candidates_[i].visitedFrame == frame_ && candidates_[i].culled;
+  }
+  return n;
+}
+
+bool OcclusionCuller::hasPendingQueries() const {
+  for (int i = 0; i < candidates_.size(); ++i) {
+    if (candidates_[i].pending)
+      return true;
+  }
+  return false;
+}
@@ -0,0 +1,102 @@
+#ifndef OCCLUSIONCULLER_H
+#define OCCLUSIONCULLER_H
+
+#include <map>
+#include <vector>
+#include <memory>
+#if __GNUG__
+#   include <tr1/memory>
+#endif
+
+#include "glsupport.h"
+#include "matrix4.h"
+#include "rigtform.h"
+#include "bounds.h"
+#include "scenegraph.h"
+#include "asstcommon.h"
+
+struct Geometry;
+
+// Skips drawing the subtrees of candidate nodes, e.g. whole robots, that
+// were hidden behind the rest of the scene.
+//
+// After the frame's draws, the bounding box of every candidate is drawn into
+// an occlusion query with color and depth writes off. The results are picked
+// up by a later beginFrame once available, never waited for, and a Drawer
+// given the culler skips the subtree of a candidate whose last result found
+// no visible samples. A candidate coming into view is thus drawn a frame or
+// two late.
+//
+// A candidate is only queried again when its eye frame, the projection or the
+// scene changed since its last query, so a still view stops querying once the
+// results are in (see hasPendingQueries).
+class OcclusionCuller : Noncopyable {
+public:
+  OcclusionCuller();
+  ~OcclusionCuller();
+
+  void addCandidate(std::tr1::shared_ptr<SgTransformNode> node);
+
+  // Forgets every query result, including those still to come, so that all
+  // candidates are drawn until new queries find them hidden. For when
+  // culling resumes after frames drawn without the culler
+  void reset();
+
+  // Picks up the query results that have arrived, and recomputes the bounds
+  // of the candidates if the scene changed
+  void beginFrame();
+
+  // Called on visiting `node' in eye frame `eyeRbt'; returns whether its
+  // subtree is to be skipped. Threads may call this at once for different
+  // nodes
+  bool enter(SgTransformNode& node, const RigTFormf& eyeRbt) {
+    if (candidates_.empty())
+      return false;
+    const std::map<SgTransformNode*, int>::const_iterator i = indices_.find(&node);
+    return i != indices_.end() && enter(candidates_[i->second], eyeRbt);
+  }
+
+  // Queries the bounds of the candidates visited since beginFrame, drawing
+  // `box' (a unit cube around the origin) with `curSS', which must be in use
+  // and take plain model view uniforms. frustNear is the z of the near plane
+  void issueQueries(const ShaderState& curSS, Geometry& box, const Matrix4& projection, double frustNear);
+
+  // Whether query results are still to come, in which case the frame should
+  // be redrawn even if nothing else changed
+  bool hasPendingQueries() const;
+
+  // Candidates skipped, and queries issued, in the current frame
+  int getNumCulled() const;
+
+  int getNumQueries() const {
+    return numQueries_;
+  }
+
+private:
+  struct Candidate {
+    std::tr1::shared_ptr<SgTransformNode> node;
+    GLuint query;
+    bool pending;                          // query issued and its result not read yet
+    bool occluded;                         // by the last result read
+    Aabb box;                              // bound of the subtree in the node's frame
+    unsigned long visitedFrame;
+    bool culled;                           // skipped in the frame it was last visited
+    Matrix4f eyeMatrix;                    // in the frame it was last visited
+    bool queried;                          // the following are valid
+    unsigned long queriedGeneration;
+    Matrix4f queriedEyeMatrix;
+  };
+
+  std::vector<Candidate> candidates_;
+  std::map<SgTransformNode*, int> indices_;
+  GLenum queryTarget_;
+  unsigned long frame_, boundsGeneration_;
+  bool boundsValid_;
+  Matrix4 queriedProjection_;
+  int numQueries_;
+
+  bool enter(Candidate& c, const RigTFormf& eyeRbt);
+  void updateBounds();
+};
+
+#endif
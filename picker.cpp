@@ -2,99 +2,187 @@
 # include <GL/glew.h>
 #endif
 
+#include <algorithm>
+
 #include "picker.h"
+#include "trace.h"
 
 using namespace std;
 using namespace std::tr1;
 
-Picker::Picker(const RigTForm& initialRbt, const ShaderState& curSS)
-  : drawer_(initialRbt, curSS)
-  , idCounter_(0)
-  , srgbFrameBuffer_(!g_Gl2Compatible) {}
-
-bool Picker::visit(SgTransformNode& node) {
-  nodeStack_.push_back(node.shared_from_this());
-  return drawer_.visit(node);
-}
+PickBuffer::PickBuffer(bool integerIds)
+  : width_(0)
+  , height_(0)
+  , integerIds_(integerIds)
+  , idToRbtNode_(1) {}
+
+void PickBuffer::beginRender(int width, int height) {
+  TRACE_SCOPE("PickBuffer::beginRender");
+  if (width != width_ || height != height_) {
+    width_ = width;
+    height_ = height;
+
+    glBindTexture(GL_TEXTURE_2D, idTex_);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    if (integerIds_)
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, width, height, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+    else
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glBindRenderbuffer(GL_RENDERBUFFER, depthRb_);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, idTex_, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthRb_);
+    // draw and read buffer selections are part of the framebuffer state
+    glDrawBuffer(GL_COLOR_ATTACHMENT0);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+  }
+  else
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
 
-bool Picker::postVisit(SgTransformNode& node) {
-  nodeStack_.pop_back();
-  return drawer_.postVisit(node);
-}
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    throw runtime_error("PickBuffer: framebuffer incomplete");
+  }
 
-bool Picker::visit(SgShapeNode& node) {
-  idCounter_++;
-  for (int i = nodeStack_.size() - 1; i >= 0; --i) {
-    shared_ptr<SgRbtNode> asRbtNode = dynamic_pointer_cast<SgRbtNode>(nodeStack_[i]);
-    if (asRbtNode) {
-      addToMap(idCounter_, asRbtNode);
-      break;
-    }
+  if (integerIds_) {
+    const GLuint zero[4] = {0, 0, 0, 0};
+    glClearBufferuiv(GL_COLOR, 0, zero);
+    glClear(GL_DEPTH_BUFFER_BIT);
+  }
+  else {
+    // We need to set the clear color to black (id 0) so let's save the clear color
+    glGetDoublev(GL_COLOR_CLEAR_VALUE, savedClearColor_);
+    glClearColor(0, 0, 0, 0);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
   }
-  const Cvec3 idColor = idToColor(idCounter_);
 
-  // DEBUG OUTPUT
-  cerr << idCounter_ << " => " << idColor[0] << ' ' << idColor[1] << ' ' << idColor[2] << endl;
+  idToRbtNode_.resize(1);
+}
 
-  safe_glUniform3f(drawer_.getCurSS().h_uIdColor, idColor[0], idColor[1], idColor[2]);
-  return drawer_.visit(node);
+void PickBuffer::endRender() {
+  TRACE_SCOPE("PickBuffer::endRender");
+  if (!integerIds_)
+    glClearColor(savedClearColor_[0], savedClearColor_[1], savedClearColor_[2], savedClearColor_[3]);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  checkGlErrors();
 }
 
-bool Picker::postVisit(SgShapeNode& node) {
-  return drawer_.postVisit(node);
+unsigned int PickBuffer::addId(shared_ptr<SgRbtNode> node) {
+  idToRbtNode_.push_back(node);
+  return idToRbtNode_.size() - 1;
 }
 
-shared_ptr<SgRbtNode> Picker::getRbtNodeAtXY(int x, int y) {
-  PackedPixel query;
-  glReadPixels(x, y, 1, 1, GL_RGB, GL_UNSIGNED_BYTE, &query);
-  const int id = colorToId(query);
+unsigned int PickBuffer::readId(int x, int y) {
+  TRACE_SCOPE("PickBuffer::readId");
+  if (x < 0 || y < 0 || x >= width_ || y >= height_)
+    return 0;
 
-  // DEBUG OUTPUT
-  cerr << int(query.r) << ' ' << int(query.g) << ' ' << int(query.b) << " => " << id << endl;
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo_);
+  unsigned int id = 0;
+  if (integerIds_)
+    glReadPixels(x, y, 1, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, &id);
+  else {
+    unsigned char p[4];
+    glReadPixels(x, y, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, p);
+    id = p[0] | (p[1] << 8) | (p[2] << 16) | (unsigned(p[3]) << 24);
+  }
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+  return id;
+}
 
-  return find(id);
+shared_ptr<SgRbtNode> PickBuffer::getRbtNodeAtXY(int x, int y) {
+  const unsigned int id = readId(x, y);
+  if (id < idToRbtNode_.size())
+    return idToRbtNode_[id];
+  else
+    return shared_ptr<SgRbtNode>(); // set to null
 }
 
-//------------------
-// Helper functions
-//------------------
-//
-void Picker::addToMap(int id, shared_ptr<SgRbtNode> node) {
-  idToRbtNode_[id] = node;
+void PickBuffer::getRbtNodesInRect(int x0, int y0, int x1, int y1,
+                                   vector<shared_ptr<SgRbtNode> >& nodes) {
+  TRACE_SCOPE("PickBuffer::getRbtNodesInRect");
+  nodes.clear();
+  if (x0 > x1)
+    swap(x0, x1);
+  if (y0 > y1)
+    swap(y0, y1);
+  x0 = max(x0, 0);
+  y0 = max(y0, 0);
+  x1 = min(x1, width_ - 1);
+  y1 = min(y1, height_ - 1);
+  if (x0 > x1 || y0 > y1)
+    return;
+
+  const int w = x1 - x0 + 1, h = y1 - y0 + 1;
+  vector<unsigned int> ids(w * h);
+
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo_);
+  if (integerIds_)
+    glReadPixels(x0, y0, w, h, GL_RED_INTEGER, GL_UNSIGNED_INT, &ids[0]);
+  else {
+    // RGBA bytes of each pixel are exactly the little endian id
+    vector<unsigned char> p(w * h * 4);
+    glReadPixels(x0, y0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, &p[0]);
+    for (int i = 0; i < w * h; ++i) {
+      ids[i] = p[4*i] | (p[4*i+1] << 8) | (p[4*i+2] << 16) | (unsigned(p[4*i+3]) << 24);
+    }
+  }
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+  // a bitmap over the ids drops the repeats of each id,
+  vector<bool> seen(idToRbtNode_.size(), false);
+  for (int i = 0; i < w * h; ++i) {
+    const unsigned int id = ids[i];
+    if (id == 0 || id >= idToRbtNode_.size() || seen[id])
+      continue;
+    seen[id] = true;
+    if (idToRbtNode_[id])
+      nodes.push_back(idToRbtNode_[id]);
+  }
+
+  // and sorting the (far fewer) owners drops shapes sharing an SgRbtNode
+  sort(nodes.begin(), nodes.end());
+  nodes.erase(unique(nodes.begin(), nodes.end()), nodes.end());
 }
 
-shared_ptr<SgRbtNode> Picker::find(int id) {
-  IdToRbtNodeMap::iterator it = idToRbtNode_.find(id);
-  if (it != idToRbtNode_.end())
-    return it->second;
-  else
-    return shared_ptr<SgRbtNode>(); // set to null
+Picker::Picker(const RigTForm& initialRbt, const ShaderState& curSS, PickBuffer& pickBuffer)
+  : ownerStack_(1)
+  , pickBuffer_(pickBuffer)
+  , drawer_(initialRbt, curSS) {}
+
+bool Picker::visit(SgTransformNode& node) {
+  // a shape belongs to its closest SgRbtNode ancestor
+  shared_ptr<SgRbtNode> asRbtNode = dynamic_pointer_cast<SgRbtNode>(node.shared_from_this());
+  ownerStack_.push_back(asRbtNode ? asRbtNode : ownerStack_.back());
+  return drawer_.visit(node);
 }
 
-// encode 2^4 = 16 IDs in each of R, G, B channel, for a total of 16^3 number of objects
-static const int NBITS = 4, N = 1 << NBITS, MASK = N-1;
+bool Picker::postVisit(SgTransformNode& node) {
+  ownerStack_.pop_back();
+  return drawer_.postVisit(node);
+}
 
-Cvec3 Picker::idToColor(int id) {
-  assert(id > 0 && id < N * N * N);
-  Cvec3 framebufferColor = Cvec3(id & MASK, (id >> NBITS) & MASK, (id >> (NBITS+NBITS)) & MASK);
-  framebufferColor = framebufferColor / N + Cvec3(0.5/N);
+bool Picker::visit(SgShapeNode& node) {
+  const unsigned int id = pickBuffer_.addId(ownerStack_.back());
+  const ShaderState& curSS = drawer_.getCurSS();
 
-  if (!srgbFrameBuffer_)
-    return framebufferColor;
+  if (pickBuffer_.usesIntegerIds())
+    safe_glUniform1ui(curSS.h_uId, id);
   else {
-    // if GL3 is used, the framebuffer will be in SRGB format, and the color we supply needs to be in linear space
-    Cvec3 linearColor;
-    for (int i = 0; i < 3; ++i) {
-      linearColor[i] = framebufferColor[i] <= 0.04045 ? framebufferColor[i]/12.92 : pow((framebufferColor[i] + 0.055)/1.055, 2.4);
-    }
-    return linearColor;
+    // exact as long as the attachment is not sRGB, which RGBA8 isn't
+    safe_glUniform4f(curSS.h_uIdColor,
+                     (id & 0xff) / 255.f, ((id >> 8) & 0xff) / 255.f,
+                     ((id >> 16) & 0xff) / 255.f, ((id >> 24) & 0xff) / 255.f);
   }
+  return drawer_.visit(node);
 }
 
-int Picker::colorToId(const PackedPixel& p) {
-  const int UNUSED_BITS = 8 - NBITS;
-  int id = p.r >> UNUSED_BITS;
-  id |= ((p.g >> UNUSED_BITS) << NBITS);
-  id |= ((p.b >> UNUSED_BITS) << (NBITS+NBITS));
-  return id;
+bool Picker::postVisit(SgShapeNode& node) {
+  return drawer_.postVisit(node);
 }
@@ -2,7 +2,6 @@
 #define PICKER_H
 
 #include <vector>
-#include <map>
 #include <memory>
 #include <stdexcept>
 #if __GNUG__
@@ -12,34 +11,72 @@
 #include "cvec.h"
 #include "scenegraph.h"
 #include "asstcommon.h"
-#include "ppm.h"
 #include "drawer.h"
 
-class Picker : public SgNodeVisitor {
-  std::vector<std::tr1::shared_ptr<SgNode> > nodeStack_;
+// An offscreen framebuffer holding the id of the shape visible at each pixel,
+// together with the flat id => SgRbtNode table for the ids it contains. Once
+// rendered it stays valid until the scene or the view changes, so repeated
+// clicks and hover queries only need to read back pixels.
+//
+// With GL3 the ids are written to an R32UI integer attachment. With GL2 they are
+// packed 8 bits per channel into an RGBA8 attachment. Either way id 0 means
+// background and about 2^32 shapes can be told apart.
+class PickBuffer : Noncopyable {
+  GlFramebufferObject fbo_;
+  GlTexture idTex_;
+  GlRenderbufferObject depthRb_;
+  int width_, height_;
+  bool integerIds_;
 
-  typedef std::map<int, std::tr1::shared_ptr<SgRbtNode> > IdToRbtNodeMap;
-  IdToRbtNodeMap idToRbtNode_;
+  std::vector<std::tr1::shared_ptr<SgRbtNode> > idToRbtNode_;
 
-  int idCounter_;
-  bool srgbFrameBuffer_;
+  GLdouble savedClearColor_[4];
 
-  Drawer drawer_;
+  unsigned int readId(int x, int y);
+
+public:
+  explicit PickBuffer(bool integerIds);
+
+  bool usesIntegerIds() const {
+    return integerIds_;
+  }
+
+  // Binds the buffer (reallocating it if the size changed), clears it and
+  // forgets all ids. Draw with a Picker between beginRender and endRender.
+  void beginRender(int width, int height);
+  void endRender();
+
+  // Allocates the next id, to be drawn for a shape owned by `node'
+  unsigned int addId(std::tr1::shared_ptr<SgRbtNode> node);
+
+  int getNumIds() const {
+    return idToRbtNode_.size() - 1;
+  }
+
+  std::tr1::shared_ptr<SgRbtNode> getRbtNodeAtXY(int x, int y);
+
+  // Collects the distinct SgRbtNodes owning any shape visible in the rectangle
+  // with corners (x0, y0) and (x1, y1) inclusive, using a single readback.
+  void getRbtNodesInRect(int x0, int y0, int x1, int y1,
+                         std::vector<std::tr1::shared_ptr<SgRbtNode> >& nodes);
+};
+
+// Draws the scene into a PickBuffer, with every shape drawn in a flat color
+// encoding its id.
+class Picker : public SgNodeVisitor {
+  std::vector<std::tr1::shared_ptr<SgRbtNode> > ownerStack_;
 
-  void addToMap(int id, std::tr1::shared_ptr<SgRbtNode> node);
-  std::tr1::shared_ptr<SgRbtNode> find(int id);
-  Cvec3 idToColor(int id);
-  int colorToId(const PackedPixel& p);
+  PickBuffer& pickBuffer_;
+
+  Drawer drawer_;
 
 public:
-  Picker(const RigTForm& initialRbt, const ShaderState& curSS);
+  Picker(const RigTForm& initialRbt, const ShaderState& curSS, PickBuffer& pickBuffer);
 
   virtual bool visit(SgTransformNode& node);
   virtual bool postVisit(SgTransformNode& node);
   virtual bool visit(SgShapeNode& node);
   virtual bool postVisit(SgShapeNode& node);
-
-  std::tr1::shared_ptr<SgRbtNode> getRbtNodeAtXY(int x, int y);
 };
 
 
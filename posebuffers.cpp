@@ -0,0 +1,96 @@
+#include <algorithm>
+
+#include "posebuffers.h"
+#include "trace.h"
+
+using namespace std;
+using namespace std::tr1;
+
+PoseBuffers::PoseBuffers(const vector<shared_ptr<SgRbtNode> >& nodes, shared_ptr<PoseSource> source)
+  : nodes_(nodes)
+  , source_(source)
+  , nextFrame_(0)
+  , backReady_(false)
+  , done_(false)
+  , stopping_(false) {
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&backFree_, NULL);
+  threadStarted_ = pthread_create(&thread_, NULL, updateThread, this) == 0;
+}
+
+PoseBuffers::~PoseBuffers() {
+  if (threadStarted_) {
+    pthread_mutex_lock(&mutex_);
+    stopping_ = true;
+    pthread_cond_signal(&backFree_);
+    pthread_mutex_unlock(&mutex_);
+    pthread_join(thread_, NULL);
+  }
+  pthread_cond_destroy(&backFree_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+// Evaluates the next frame into back_, which the caller must own, i.e.,
+// backReady_ and done_ are false; returns whether there was one
+bool PoseBuffers::evaluateNext() {
+  TRACE_SCOPE("PoseBuffers::evaluateNext");
+  const bool more = source_->evaluate(nextFrame_, back_);
+  pthread_mutex_lock(&mutex_);
+  if (more) {
+    ++nextFrame_;
+    backReady_ = true;
+  }
+  else
+    done_ = true;
+  pthread_mutex_unlock(&mutex_);
+  return more;
+}
+
+void* PoseBuffers::updateThread(void *arg) {
+  TRACE_SCOPE("poseUpdateThread");
+  PoseBuffers& b = *static_cast<PoseBuffers*>(arg);
+  pthread_mutex_lock(&b.mutex_);
+  while (!b.stopping_) {
+    if (b.backReady_) {
+      pthread_cond_wait(&b.backFree_, &b.mutex_);
+      continue;
+    }
+    pthread_mutex_unlock(&b.mutex_);
+    const bool more = b.evaluateNext();
+    pthread_mutex_lock(&b.mutex_);
+    if (!more)
+      break;
+  }
+  pthread_mutex_unlock(&b.mutex_);
+  return NULL;
+}
+
+bool PoseBuffers::swap() {
+  TRACE_SCOPE("PoseBuffers::swap");
+  if (!threadStarted_ && !backReady_ && !done_)
+    evaluateNext();
+
+  pthread_mutex_lock(&mutex_);
+  const bool ready = backReady_;
+  if (ready) {
+    front_.swap(back_);
+    backReady_ = false;
+    pthread_cond_signal(&backFree_);
+  }
+  pthread_mutex_unlock(&mutex_);
+  if (!ready)
+    return false;
+
+  // front_ is the render thread's alone until the next swap
+  for (int i = 0, n = min(nodes_.size(), front_.size()); i < n; ++i) {
+    nodes_[i]->setRbt(front_[i]);
+  }
+  return true;
+}
+
+bool PoseBuffers::finished() {
+  pthread_mutex_lock(&mutex_);
+  const bool finished = done_ && !backReady_;
+  pthread_mutex_unlock(&mutex_);
+  return finished;
+}
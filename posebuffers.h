@@ -0,0 +1,68 @@
+#ifndef POSEBUFFERS_H
+#define POSEBUFFERS_H
+
+#include <vector>
+#include <memory>
+#if __GNUG__
+#   include <tr1/memory>
+#endif
+#include <pthread.h>
+
+#include "glsupport.h"
+#include "rigtform.h"
+#include "scenegraph.h"
+
+// The poses of one frame after another, e.g. of an animation. evaluate is
+// called on the update thread only, so it must not touch the scene graph.
+class PoseSource {
+public:
+  virtual ~PoseSource() {}
+
+  // Sets `poses' to those of frame `frame' (0, 1, ...); returns false, leaving
+  // `poses' alone, past the last frame
+  virtual bool evaluate(int frame, std::vector<RigTForm>& poses) = 0;
+};
+
+// Double buffered poses for a list of SgRbtNodes. An update thread evaluates
+// the next frame of a PoseSource into the back buffer while the render thread
+// draws the scene as set from the front buffer; swap, called between frames,
+// exchanges the two once the back one is complete. The update thread stays at
+// most one frame ahead and never touches the nodes, so the scene graph is
+// still only read and written by the render thread.
+class PoseBuffers : Noncopyable {
+public:
+  // Starts evaluating frame 0. poses[i] goes to nodes[i]; extra poses or
+  // nodes are left out
+  PoseBuffers(const std::vector<std::tr1::shared_ptr<SgRbtNode> >& nodes, std::tr1::shared_ptr<PoseSource> source);
+
+  // Stops the update thread, waiting for the frame it is evaluating
+  ~PoseBuffers();
+
+  // If the next frame is ready, makes it the front buffer, sets the nodes
+  // from it and lets the update thread go on; returns whether it did. Never
+  // waits, except for evaluating the frame itself when no update thread
+  // could be started
+  bool swap();
+
+  // Whether the source ran out of frames and every frame was swapped in
+  bool finished();
+
+private:
+  std::vector<std::tr1::shared_ptr<SgRbtNode> > nodes_;
+  std::tr1::shared_ptr<PoseSource> source_;
+  std::vector<RigTForm> front_, back_;
+  int nextFrame_;                          // the one being evaluated into back_
+  bool backReady_;                         // back_ holds a frame not swapped in yet
+  bool done_;                              // the source ran out of frames
+  bool stopping_;
+
+  pthread_t thread_;
+  bool threadStarted_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t backFree_;
+
+  bool evaluateNext();
+  static void* updateThread(void *arg);
+};
+
+#endif
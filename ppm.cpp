@@ -6,6 +6,12 @@
 #include <vector>
 #include <string>
 #include <stdexcept>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #ifdef __MAC__
 # include <GLUT/glut.h>
@@ -15,10 +21,13 @@
 #endif
 
 #include "ppm.h"
+#include "trace.h"
 
 using namespace std;
+using namespace std::tr1;
 
 void writePpmScreenshot(const int width, const int height, const char *filename) {
+  TRACE_SCOPE("writePpmScreenshot");
   vector<char> image(width*height*3);
 
   glReadPixels(0,0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &image[0]);
@@ -30,13 +39,15 @@ void writePpmScreenshot(const int width, const int height, const char *filename)
   }
 }
 
-// Read one positive integer from a (text) file. Line beginning with
-// "#" are ignored as comments.
-static int ppmReadInteger(istream& is) {
-  unsigned char ch;
-  int got = 0, done = 0, accum = 0, inComment = 0;
-  while (!done) {
-    ch = is.get();
+// Parse one positive integer from an in-memory (text) buffer, advancing `p'
+// past it and the single whitespace character that terminates it. Lines
+// beginning with "#" are ignored as comments.
+static int ppmParseInteger(const char *&p, const char *end) {
+  int got = 0, accum = 0, inComment = 0;
+  while (true) {
+    if (p == end)
+      throw runtime_error("ppmRead: unexpected end of file");
+    const unsigned char ch = *p++;
 
     if (inComment) {
       if (ch=='\n')
@@ -44,7 +55,7 @@ static int ppmReadInteger(istream& is) {
       continue;
     }
 
-    if (isdigit(ch)) {
+    if (ch >= '0' && ch <= '9') {
       accum = accum*10 + ch-'0';
       got = 1;
     }
@@ -53,64 +64,228 @@ static int ppmReadInteger(istream& is) {
     else if (!ch || !strchr(" \t\r\n", ch))
       throw runtime_error("ppmRead: invalid character");
     else if (got)
-      done = 1;
+      return accum;
     else
       ; // nothing
   }
-  return accum;
 }
 
-// Read the PPM header from the input stream and initialize the width and height
-// to the appropriate values, and throws rumtime_error on invalid width/height
-static void ppmReadHeader(istream& is, int &width, int &height) {
-  if ((width = ppmReadInteger(is)) < 0) {
+// Parse the PPM header following the magic number and initialize the width and
+// height to the appropriate values. Throws rumtime_error on invalid width/height
+static void ppmParseHeader(const char *&p, const char *end, int &width, int &height) {
+  if ((width = ppmParseInteger(p, end)) < 0) {
     throw runtime_error("ppmRead: invalid width");
   }
-  if ((height = ppmReadInteger(is)) < 0) {
+  if ((height = ppmParseInteger(p, end)) < 0) {
     throw runtime_error("ppmRead: invalid height");
   }
-  if (ppmReadInteger(is) != 255) {
+  const int maxColor = ppmParseInteger(p, end);
+  if (maxColor > 255)
+    throw runtime_error("ppmRead: 16-bit samples are not supported");
+  if (maxColor != 255) {
     cerr << "Warning: maxcolor not 255 : won't work well" << endl;
   }
 }
 
-//Reads the actual PPM data and stores returns in in a pixels.
-void ppmRead(const char *filename, int& width, int& height, std::vector<PackedPixel>& pixels) {
-  ifstream is(filename, ios::binary);
-  if (!is.is_open())
+PpmMappedImage::PpmMappedImage()
+  : map_(NULL), mapLen_(0), width_(0), height_(0), pixels_(NULL) {}
+
+PpmMappedImage::PpmMappedImage(const char *filename)
+  : map_(NULL), mapLen_(0), width_(0), height_(0), pixels_(NULL) {
+  open(filename);
+}
+
+PpmMappedImage::~PpmMappedImage() {
+  close();
+}
+
+void PpmMappedImage::close() {
+  if (map_)
+    munmap(map_, mapLen_);
+  map_ = NULL;
+  mapLen_ = 0;
+  width_ = height_ = 0;
+  pixels_ = NULL;
+  vector<PackedPixel>().swap(decoded_);
+}
+
+void PpmMappedImage::open(const char *filename) {
+  TRACE_SCOPE("PpmMappedImage::open");
+  close();
+
+  const int fd = ::open(filename, O_RDONLY);
+  if (fd < 0)
     throw runtime_error(string("ppmRead: Cannot open file ") + filename + " for read");
 
-  // Sets bits to report IO error using exception
-  is.exceptions(ios::eofbit | ios::failbit | ios::badbit);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < 2) {
+    ::close(fd);
+    throw runtime_error(string("ppmRead: bad file format in ") + filename);
+  }
 
-  char buf[2];
-  is.read(buf, 2);
+  int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+  flags |= MAP_POPULATE; // fault the whole file in now, so batch loads overlap IO
+#endif
+  void *m = mmap(NULL, st.st_size, PROT_READ, flags, fd, 0);
+  ::close(fd); // the mapping keeps its own reference to the file
+  if (m == MAP_FAILED)
+    throw runtime_error(string("ppmRead: Cannot map file ") + filename);
+  map_ = m;
+  mapLen_ = st.st_size;
+  madvise(map_, mapLen_, MADV_SEQUENTIAL);
 
-  bool isbinary = false;
-  if (!memcmp(buf, "P3", 2))
-    isbinary = false;
-  else if (!memcmp(buf, "P6", 2))
-    isbinary = true;
-  else
-    throw runtime_error("ppmRead: bad file format");
+  try {
+    const char *p = static_cast<const char*>(map_);
+    const char *end = p + mapLen_;
 
-  ppmReadHeader(is, width, height);
+    bool isbinary = false;
+    if (!memcmp(p, "P3", 2))
+      isbinary = false;
+    else if (!memcmp(p, "P6", 2))
+      isbinary = true;
+    else
+      throw runtime_error("ppmRead: bad file format");
+    p += 2;
 
-  pixels.resize(width * height);
+    int width, height;
+    ppmParseHeader(p, end, width, height);
 
-  if (isbinary) {
-    for (int row = height - 1; row >= 0; row--) {
-      is.read(reinterpret_cast<char*>(&pixels[row * width]), width * sizeof(PackedPixel));
+    const size_t numPixels = size_t(width) * height;
+    if (isbinary) {
+      if (size_t(end - p) < numPixels * sizeof(PackedPixel))
+        throw runtime_error("ppmRead: truncated pixel data");
+      pixels_ = reinterpret_cast<const PackedPixel*>(p);
     }
-  }
-  else {
-    for (int row = height - 1; row >= 0; row--) {
-      for (int l = 0; l < width; l++) {
-        PackedPixel &p = pixels[row * width + l];
-        p.r = ppmReadInteger(is);
-        p.g = ppmReadInteger(is);
-        p.b = ppmReadInteger(is);
+    else {
+      decoded_.resize(numPixels);
+      for (size_t i = 0; i < numPixels; ++i) {
+        PackedPixel &px = decoded_[i];
+        px.r = ppmParseInteger(p, end);
+        px.g = ppmParseInteger(p, end);
+        px.b = ppmParseInteger(p, end);
       }
+      pixels_ = decoded_.empty() ? NULL : &decoded_[0];
+    }
+    width_ = width;
+    height_ = height;
+  }
+  catch (...) {
+    close();
+    throw;
+  }
+}
+
+void PpmMappedImage::copyTo(vector<PackedPixel>& out, bool flipRows) const {
+  out.resize(size_t(width_) * height_);
+  if (out.empty())
+    return;
+  if (!flipRows) {
+    memcpy(&out[0], pixels_, out.size() * sizeof(PackedPixel));
+    return;
+  }
+  for (int r = 0; r < height_; ++r) {
+    memcpy(&out[size_t(height_ - 1 - r) * width_], row(r), width_ * sizeof(PackedPixel));
+  }
+}
+
+void PpmMappedImage::copyToRgba(vector<unsigned char>& out, bool flipRows, unsigned char alpha) const {
+  out.resize(size_t(width_) * height_ * 4);
+  for (int r = 0; r < height_; ++r) {
+    const PackedPixel *src = row(r);
+    unsigned char *dst = &out[size_t(flipRows ? height_ - 1 - r : r) * width_ * 4];
+    for (int c = 0; c < width_; ++c, dst += 4) {
+      dst[0] = src[c].r;
+      dst[1] = src[c].g;
+      dst[2] = src[c].b;
+      dst[3] = alpha;
     }
   }
 }
+
+//Reads the actual PPM data and stores returns in in a pixels.
+void ppmRead(const char *filename, int& width, int& height, std::vector<PackedPixel>& pixels) {
+  TRACE_SCOPE("ppmRead");
+  PpmMappedImage image(filename);
+  width = image.width();
+  height = image.height();
+  image.copyTo(pixels, true);
+}
+
+namespace {
+struct PpmBatchJob {
+  const vector<string> *filenames;
+  vector<shared_ptr<PpmMappedImage> > *images;
+  vector<string> errors;
+  int numThreads;
+};
+
+struct PpmBatchWorker {
+  PpmBatchJob *job;
+  int threadId;
+};
+}
+
+static void *ppmBatchThread(void *arg) {
+  TRACE_SCOPE("ppmBatchThread");
+  const PpmBatchWorker &w = *static_cast<PpmBatchWorker*>(arg);
+  PpmBatchJob &job = *w.job;
+  // Each worker takes every numThreads'th file; images and errors are
+  // preallocated so no two threads touch the same slot
+  for (size_t i = w.threadId; i < job.filenames->size(); i += job.numThreads) {
+    try {
+      (*job.images)[i]->open((*job.filenames)[i].c_str());
+    }
+    catch (const exception& e) {
+      job.errors[i] = (*job.filenames)[i] + ": " + e.what();
+    }
+  }
+  return NULL;
+}
+
+void ppmReadBatch(const vector<string>& filenames,
+                  vector<shared_ptr<PpmMappedImage> >& images,
+                  int numThreads) {
+  TRACE_SCOPE("ppmReadBatch");
+  images.resize(filenames.size());
+  for (size_t i = 0; i < images.size(); ++i) {
+    images[i].reset(new PpmMappedImage());
+  }
+  if (filenames.empty())
+    return;
+
+  if (numThreads <= 0)
+    numThreads = max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+  numThreads = min<int>(numThreads, filenames.size());
+
+  PpmBatchJob job;
+  job.filenames = &filenames;
+  job.images = &images;
+  job.errors.resize(filenames.size());
+  job.numThreads = numThreads;
+
+  vector<PpmBatchWorker> workers(numThreads);
+  vector<pthread_t> threads(numThreads);
+  vector<bool> started(numThreads, false);
+  for (int i = 0; i < numThreads; ++i) {
+    workers[i].job = &job;
+    workers[i].threadId = i;
+    // the calling thread runs worker 0 itself
+    if (i > 0)
+      started[i] = pthread_create(&threads[i], NULL, ppmBatchThread, &workers[i]) == 0;
+  }
+  // Also pick up the share of any worker whose thread could not be created
+  for (int i = 0; i < numThreads; ++i) {
+    if (!started[i])
+      ppmBatchThread(&workers[i]);
+  }
+  for (int i = 1; i < numThreads; ++i) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+  }
+
+  for (size_t i = 0; i < job.errors.size(); ++i) {
+    if (!job.errors[i].empty())
+      throw runtime_error("ppmReadBatch: " + job.errors[i]);
+  }
+}
@@ -2,6 +2,11 @@
 #define PPM_H
 
 #include <vector>
+#include <string>
+#include <memory>
+#if __GNUG__
+#   include <tr1/memory>
+#endif
 
 void writePpmScreenshot(const int width, const int height, const char *filename);
 
@@ -15,4 +20,57 @@ struct PackedPixel {
 // and `height'. Throws an exception on error.
 void ppmRead(const char *filename, int& width, int& height, std::vector<PackedPixel>& pixels);
 
+// A PPM image memory-mapped from disk. The header is parsed in place, and for
+// binary (P6) files the pixels are exposed directly from the mapping without
+// any copy. ASCII (P3) files are decoded once into an owned buffer.
+//
+// Rows are in file order, i.e., row 0 is the top of the image. Use copyTo to
+// get a bottom-up (OpenGL ordered) copy like ppmRead does.
+class PpmMappedImage {
+  void *map_;
+  size_t mapLen_;
+  int width_, height_;
+  const PackedPixel *pixels_;
+  std::vector<PackedPixel> decoded_; // only used for P3 files
+
+  PpmMappedImage(const PpmMappedImage&);
+  const PpmMappedImage& operator= (const PpmMappedImage&);
+
+public:
+  PpmMappedImage();
+  explicit PpmMappedImage(const char *filename);
+  ~PpmMappedImage();
+
+  // Maps and parses `filename', releasing any previously opened image.
+  // Throws runtime_error on error
+  void open(const char *filename);
+  void close();
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  // true if pixels() points into the file mapping rather than a decoded copy
+  bool isZeroCopy() const { return map_ != NULL && decoded_.empty(); }
+
+  const PackedPixel* pixels() const { return pixels_; }
+
+  const PackedPixel* row(const int r) const {
+    return pixels_ + r * width_;
+  }
+
+  // Copies the pixels into `out'. If flipRows is set, row 0 of the output is
+  // the bottom row of the image, matching ppmRead and glTexImage2D.
+  void copyTo(std::vector<PackedPixel>& out, bool flipRows = true) const;
+
+  // Same as copyTo but expands each pixel to 4 bytes RGBA with the given alpha
+  void copyToRgba(std::vector<unsigned char>& out, bool flipRows = true, unsigned char alpha = 255) const;
+};
+
+// Maps and parses many PPM files in parallel, using up to numThreads worker
+// threads (0 means one per online CPU). images[i] corresponds to filenames[i].
+// Throws runtime_error naming the first file that failed.
+void ppmReadBatch(const std::vector<std::string>& filenames,
+                  std::vector<std::tr1::shared_ptr<PpmMappedImage> >& images,
+                  int numThreads = 0);
+
 #endif
@@ -154,4 +154,76 @@ inline Matrix4 quatToMatrix(const Quat& q) {
   return r;
 }
 
+// A single precision quaternion for the render path, same layout as Quat
+class Quatf {
+  CS175_ALIGN16 float q_[4];  // layout is: q_[0]==w, q_[1]==x, q_[2]==y, q_[3]==z
+
+public:
+  float operator [] (const int i) const {
+    return q_[i];
+  }
+
+  float& operator [] (const int i) {
+    return q_[i];
+  }
+
+  Quatf() {
+    q_[0] = 1;
+    q_[1] = q_[2] = q_[3] = 0;
+  }
+
+  Quatf(const float w, const float x, const float y, const float z) {
+    q_[0] = w;
+    q_[1] = x;
+    q_[2] = y;
+    q_[3] = z;
+  }
+
+  explicit Quatf(const Quat& q) {
+    for (int i = 0; i < 4; ++i) {
+      q_[i] = float(q[i]);
+    }
+  }
+
+  Quat toQuat() const {
+    return Quat(q_[0], q_[1], q_[2], q_[3]);
+  }
+
+  Quatf operator * (const Quatf& a) const {
+    const float w = q_[0], x = q_[1], y = q_[2], z = q_[3];
+    return Quatf(w*a[0] - x*a[1] - y*a[2] - z*a[3],
+                 w*a[1] + x*a[0] + y*a[3] - z*a[2],
+                 w*a[2] - x*a[3] + y*a[0] + z*a[1],
+                 w*a[3] + x*a[2] - y*a[1] + z*a[0]);
+  }
+
+  // Rotates v, like q * v * inv(q) does for Quat
+  Cvec3f rotate(const Cvec3f& v) const {
+    const Cvec3f u(q_[1], q_[2], q_[3]);
+    const float n = q_[0]*q_[0] + dot(u, u);
+    assert(n > CS175_EPS2);
+    const Cvec3f uv = cross(u, v);
+    return v + (uv * q_[0] + cross(u, uv)) * (2 / n);
+  }
+};
+
+inline Matrix4f quatToMatrix(const Quatf& q) {
+  Matrix4f r;
+  const float n = q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3];
+  if (n < CS175_EPS2)
+    return Matrix4f(0.f);
+
+  const float two_over_n = 2/n;
+  r(0, 0) -= (q[2]*q[2] + q[3]*q[3]) * two_over_n;
+  r(0, 1) += (q[1]*q[2] - q[0]*q[3]) * two_over_n;
+  r(0, 2) += (q[1]*q[3] + q[2]*q[0]) * two_over_n;
+  r(1, 0) += (q[1]*q[2] + q[0]*q[3]) * two_over_n;
+  r(1, 1) -= (q[1]*q[1] + q[3]*q[3]) * two_over_n;
+  r(1, 2) += (q[2]*q[3] - q[1]*q[0]) * two_over_n;
+  r(2, 0) += (q[1]*q[3] - q[2]*q[0]) * two_over_n;
+  r(2, 1) += (q[2]*q[3] + q[1]*q[0]) * two_over_n;
+  r(2, 2) -= (q[1]*q[1] + q[2]*q[2]) * two_over_n;
+  return r;
+}
+
 #endif
@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "raypicker.h"
+
+using namespace std;
+using namespace std::tr1;
+
+// Shapes per BVH leaf
+static const int BVH_LEAF_SIZE = 4;
+
+RayPicker::RayPicker(const RigTForm& initialRbt)
+  : rbtStack_(1, initialRbt)
+  , ownerStack_(1)
+  , bvhBuilt_(false) {}
+
+bool RayPicker::visit(SgTransformNode& node) {
+  rbtStack_.push_back(rbtStack_.back() * node.getRbt());
+
+  // a shape belongs to its closest SgRbtNode ancestor
+  shared_ptr<SgRbtNode> asRbtNode = dynamic_pointer_cast<SgRbtNode>(node.shared_from_this());
+  ownerStack_.push_back(asRbtNode ? asRbtNode : ownerStack_.back());
+  return true;
+}
+
+bool RayPicker::postVisit(SgTransformNode& node) {
+  rbtStack_.pop_back();
+  ownerStack_.pop_back();
+  return true;
+}
+
+bool RayPicker::visit(SgShapeNode& node) {
+  Prim p;
+  p.MVM = rigTFormToMatrix(rbtStack_.back()) * node.getAffineMatrix();
+  p.bound = node.getLocalBound();
+  p.eyeBox = transformAabb(p.MVM, p.bound.box);
+  p.owner = ownerStack_.back();
+  if (!p.eyeBox.isEmpty())
+    prims_.push_back(p);
+  bvhBuilt_ = false;
+  return true;
+}
+
+namespace {
+template<typename PrimVector>
+struct CentroidLess {
+  const PrimVector& prims;
+  int axis;
+  CentroidLess(const PrimVector& prims, int axis) : prims(prims), axis(axis) {}
+  bool operator() (int a, int b) const {
+    return prims[a].eyeBox.lo[axis] + prims[a].eyeBox.hi[axis] < prims[b].eyeBox.lo[axis] + prims[b].eyeBox.hi[axis];
+  }
+};
+}
+
+// Recursively builds the subtree for primOrder_[first, first + count) by
+// splitting at the median centroid along the longest axis. Returns its index.
+int RayPicker::buildBvh(int first, int count) {
+  const int idx = bvh_.size();
+  bvh_.push_back(BvhNode());
+
+  Aabb box, centroidBox;
+  for (int i = first; i < first + count; ++i) {
+    box.add(prims_[primOrder_[i]].eyeBox);
+    centroidBox.add(prims_[primOrder_[i]].eyeBox.center());
+  }
+  bvh_[idx].box = box;
+
+  if (count <= BVH_LEAF_SIZE) {
+    bvh_[idx].first = first;
+    bvh_[idx].count = count;
+    bvh_[idx].right = -1;
+    return idx;
+  }
+
+  const Cvec3 e = centroidBox.extent();
+  const int axis = e[0] > e[1] ? (e[0] > e[2] ? 0 : 2) : (e[1] > e[2] ? 1 : 2);
+
+  const int half = count / 2;
+  nth_element(primOrder_.begin() + first, primOrder_.begin() + first + half,
+              primOrder_.begin() + first + count, CentroidLess<vector<Prim> >(prims_, axis));
+
+  bvh_[idx].first = first;
+  bvh_[idx].count = 0;
+  buildBvh(first, half);
+  const int right = buildBvh(first + half, count - half);
+  bvh_[idx].right = right;
+  return idx;
+}
+
+void RayPicker::buildBvh() {
+  bvh_.clear();
+  primOrder_.resize(prims_.size());
+  for (int i = 0, n = prims_.size(); i < n; ++i) {
+    primOrder_[i] = i;
+  }
+  if (!prims_.empty())
+    buildBvh(0, prims_.size());
+  bvhBuilt_ = true;
+}
+
+shared_ptr<SgRbtNode> RayPicker::castRay(const Cvec3& o, const Cvec3& d, double& t) {
+  if (!bvhBuilt_)
+    buildBvh();
+
+  t = numeric_limits<double>::max();
+  int best = -1;
+  if (bvh_.empty())
+    return shared_ptr<SgRbtNode>();
+
+  vector<int> stack(1, 0);
+  while (!stack.empty()) {
+    const BvhNode& n = bvh_[stack.back()];
+    const int nodeIdx = stack.back();
+    stack.pop_back();
+
+    double tNear, tFar;
+    if (!intersectRayAabb(o, d, n.box, tNear, tFar) || tFar <= 0 || tNear >= t)
+      continue;
+
+    if (n.count > 0) {
+      for (int i = n.first; i < n.first + n.count; ++i) {
+        const Prim& p = prims_[primOrder_[i]];
+        double boxNear, boxFar;
+        if (!intersectRayAabb(o, d, p.eyeBox, boxNear, boxFar) || boxFar <= 0 || boxNear >= t)
+          continue;
+
+        // exact test in the object frame; affine maps keep the ray parameter
+        const Matrix4 invMVM = inv(p.MVM);
+        const Cvec3 lo = Cvec3(invMVM * Cvec4(o, 1));
+        const Cvec3 ld = Cvec3(invMVM * Cvec4(d, 0));
+        double hit;
+        if (intersectRayShapeBound(lo, ld, p.bound, hit) && hit < t) {
+          t = hit;
+          best = primOrder_[i];
+        }
+      }
+    }
+    else {
+      stack.push_back(n.right);
+      stack.push_back(nodeIdx + 1);
+    }
+  }
+  return best < 0 ? shared_ptr<SgRbtNode>() : prims_[best].owner;
+}
+
+shared_ptr<SgRbtNode> RayPicker::getRbtNodeAtXY(int x, int y,
+                                                double frustFovY, int screenWidth, int screenHeight) {
+  // invert the viewport and projection mapping of getScreenSpaceCoord
+  const double ndcX = (x - (screenWidth - 1) / 2.0) * 2.0 / screenWidth;
+  const double ndcY = (y - (screenHeight - 1) / 2.0) * 2.0 / screenHeight;
+  const double tanHalfFovY = tan(frustFovY * CS175_PI / 360.0);
+  const double aspect = screenWidth / static_cast<double>(screenHeight);
+
+  double t;
+  return castRay(Cvec3(), Cvec3(ndcX * tanHalfFovY * aspect, ndcY * tanHalfFovY, -1), t);
+}
@@ -0,0 +1,63 @@
+#ifndef RAYPICKER_H
+#define RAYPICKER_H
+
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#if __GNUG__
+#   include <tr1/memory>
+#endif
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "bounds.h"
+#include "scenegraph.h"
+
+// Picks on the CPU by casting a ray from the eye through a pixel and
+// intersecting it with the bound of every shape (boxes, and spheres which the
+// affine matrix turns into ellipsoids). The shapes are gathered in eye
+// coordinates during traversal and organized in a bounding volume hierarchy,
+// so no rendering or GL readback is needed.
+class RayPicker : public SgNodeVisitor {
+  struct Prim {
+    Aabb eyeBox;         // bound of the shape in eye coordinates
+    Matrix4 MVM;         // object to eye
+    ShapeBound bound;    // bound in object coordinates
+    std::tr1::shared_ptr<SgRbtNode> owner;
+  };
+
+  struct BvhNode {
+    Aabb box;
+    int first, count;    // range in primOrder_ if a leaf (count > 0)
+    int right;           // index of the right child; the left one is next
+  };
+
+  std::vector<RigTForm> rbtStack_;
+  std::vector<std::tr1::shared_ptr<SgRbtNode> > ownerStack_;
+
+  std::vector<Prim> prims_;
+  std::vector<int> primOrder_;
+  std::vector<BvhNode> bvh_;
+  bool bvhBuilt_;
+
+  int buildBvh(int first, int count);
+  void buildBvh();
+
+public:
+  RayPicker(const RigTForm& initialRbt);
+
+  virtual bool visit(SgTransformNode& node);
+  virtual bool postVisit(SgTransformNode& node);
+  virtual bool visit(SgShapeNode& node);
+
+  // Returns the owning SgRbtNode of the closest shape under the eye ray
+  // through pixel (x, y) (in OpenGL window coordinates), or null on a miss.
+  std::tr1::shared_ptr<SgRbtNode> getRbtNodeAtXY(int x, int y,
+                                                 double frustFovY, int screenWidth, int screenHeight);
+
+  // Returns the owning SgRbtNode of the closest shape hit by the eye space ray
+  // o + t d, and stores the hit parameter into t.
+  std::tr1::shared_ptr<SgRbtNode> castRay(const Cvec3& o, const Cvec3& d, double& t);
+};
+
+#endif
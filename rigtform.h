@@ -69,4 +69,40 @@ inline Matrix4 rigTFormToMatrix(const RigTForm& tform) {
   return m;
 }
 
+// A single precision RigTForm for the render path. Editing keeps using the
+// double precision types; convert explicitly when handing a frame to it.
+class RigTFormf {
+  Quatf r_;  // rotation component represented as a quaternion
+  Cvec3f t_; // translation component
+
+public:
+  RigTFormf() : t_(0) {}
+  RigTFormf(const Cvec3f& t, const Quatf& r) : r_(r), t_(t) {}
+
+  explicit RigTFormf(const RigTForm& tform)
+    : r_(tform.getRotation())
+    , t_(Cvec3f(tform.getTranslation()[0], tform.getTranslation()[1], tform.getTranslation()[2])) {}
+
+  Cvec3f getTranslation() const {
+    return t_;
+  }
+
+  Quatf getRotation() const {
+    return r_;
+  }
+
+  RigTFormf operator * (const RigTFormf& a) const {
+    return RigTFormf(t_ + r_.rotate(a.t_), r_ * a.r_);
+  }
+};
+
+inline Matrix4f rigTFormToMatrix(const RigTFormf& tform) {
+  Matrix4f m = quatToMatrix(tform.getRotation());
+  const Cvec3f t = tform.getTranslation();
+  for (int i = 0; i < 3; ++i) {
+    m(i, 3) = t[i];
+  }
+  return m;
+}
+
 #endif
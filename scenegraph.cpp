@@ -2,10 +2,21 @@
 #include <cassert>
 
 #include "scenegraph.h"
+#include "trace.h"
 
 using namespace std;
 using namespace std::tr1;
 
+static unsigned long g_sceneGeneration = 0;
+
+unsigned long getSceneGeneration() {
+  return g_sceneGeneration;
+}
+
+void bumpSceneGeneration() {
+  ++g_sceneGeneration;
+}
+
 bool SgTransformNode::accept(SgNodeVisitor& visitor) {
   if (!visitor.visit(*this))
     return false;
@@ -18,10 +29,12 @@ bool SgTransformNode::accept(SgNodeVisitor& visitor) {
 
 void SgTransformNode::addChild(shared_ptr<SgNode> child) {
   children_.push_back(child);
+  bumpSceneGeneration();
 }
 
 void SgTransformNode::removeChild(shared_ptr<SgNode> child) {
   children_.erase(find(children_.begin(), children_.end(), child));
+  bumpSceneGeneration();
 }
 
 bool SgShapeNode::accept(SgNodeVisitor& visitor) {
@@ -70,6 +83,7 @@ RigTForm getPathAccumRbt(
   shared_ptr<SgTransformNode> destination,
   int offsetFromDestination) {
 
+  TRACE_SCOPE("getPathAccumRbt");
   assert(source);
   assert(destination);
 
@@ -77,3 +91,80 @@ RigTForm getPathAccumRbt(
   source->accept(accum);
   return accum.getAccumulatedRbt(offsetFromDestination);
 }
+
+class RbtMultiAccumVisitor : public SgNodeVisitor {
+protected:
+  typedef pair<const SgNode*, int> Target; // (destination, its index)
+
+  vector<RigTForm> rbtStack_;
+  vector<Target> targets_;                 // sorted for binary search
+  vector<bool> found_;
+  vector<const SgNode*> enclosing_;        // destinations we are inside of
+  int offset_;
+  vector<RigTForm>& rbts_;
+  vector<bool> *nested_;
+
+public:
+  RbtMultiAccumVisitor(const vector<shared_ptr<SgTransformNode> >& destinations,
+                       int offsetFromDestination, vector<RigTForm>& rbts, vector<bool> *nested)
+    : found_(destinations.size(), false)
+    , offset_(offsetFromDestination)
+    , rbts_(rbts)
+    , nested_(nested) {
+    for (int i = 0, n = destinations.size(); i < n; ++i) {
+      assert(destinations[i]);
+      targets_.push_back(Target(destinations[i].get(), i));
+    }
+    sort(targets_.begin(), targets_.end());
+    rbts_.assign(destinations.size(), RigTForm());
+    if (nested_)
+      nested_->assign(destinations.size(), false);
+  }
+
+  void checkAllFound() const {
+    if (find(found_.begin(), found_.end(), false) != found_.end())
+      throw runtime_error("RbtMultiAccumVisitor target never reached");
+  }
+
+  virtual bool visit(SgTransformNode& node) {
+    if (rbtStack_.empty())
+      rbtStack_.push_back(RigTForm());
+    else
+      rbtStack_.push_back(rbtStack_.back() * node.getRbt());
+
+    vector<Target>::const_iterator it = lower_bound(targets_.begin(), targets_.end(), Target(&node, -1));
+    if (it == targets_.end() || it->first != &node)
+      return true;
+
+    for (; it != targets_.end() && it->first == &node; ++it) {
+      found_[it->second] = true;
+      rbts_[it->second] = rbtStack_[rbtStack_.size()-1-offset_];
+      if (nested_)
+        (*nested_)[it->second] = !enclosing_.empty();
+    }
+    enclosing_.push_back(&node);
+    return true;
+  }
+
+  virtual bool postVisit(SgTransformNode& node) {
+    rbtStack_.pop_back();
+    if (!enclosing_.empty() && enclosing_.back() == &node)
+      enclosing_.pop_back();
+    return true;
+  }
+};
+
+void getPathAccumRbts(
+  shared_ptr<SgTransformNode> source,
+  const vector<shared_ptr<SgTransformNode> >& destinations,
+  vector<RigTForm>& rbts,
+  int offsetFromDestination,
+  vector<bool> *nested) {
+
+  TRACE_SCOPE("getPathAccumRbts");
+  assert(source);
+
+  RbtMultiAccumVisitor accum(destinations, offsetFromDestination, rbts, nested);
+  source->accept(accum);
+  accum.checkAllFound();
+}
@@ -11,10 +11,12 @@
 #include "cvec.h"
 #include "matrix4.h"
 #include "rigtform.h"
+#include "bounds.h"
 #include "glsupport.h" // for Noncopyable
 #include "asstcommon.h"
 
 class SgNodeVisitor;
+class InstancedDrawList;
 
 class SgNode : public std::tr1::enable_shared_from_this<SgNode>, Noncopyable {
 public:
@@ -69,7 +71,29 @@ public:
   virtual bool accept(SgNodeVisitor& visitor);
 
   virtual Matrix4 getAffineMatrix() = 0;
-  virtual void draw(const ShaderState& curSS) = 0;
+  virtual Matrix4f getAffineMatrixf() = 0; // same, for the render path
+
+  // Levels of detail, 0 being the finest. selectLod picks the level to draw
+  // when the local bound's radius covers `radiusPixels' pixels on screen.
+  virtual int getNumLods() { return 1; }
+  virtual int selectLod(double radiusPixels) { return 0; }
+
+  // The normal matrix of the affine matrix. Shapes knowing how their affine
+  // matrix was built should override this to avoid the general inverse.
+  virtual Matrix4f getNormalMatrixf() {
+    return normalMatrix(getAffineMatrixf());
+  }
+  virtual void draw(const ShaderState& curSS, int lod) = 0;
+
+  // Bounding primitive of the geometry, before the affine matrix is applied
+  virtual ShapeBound getLocalBound() = 0;
+
+  // Shapes with the same non-NULL instance key at the given levels draw the
+  // same geometry, and a run of them can be drawn by a single
+  // addInstancedDraw call on any one
+  virtual const void* getInstanceKey(int lod) { return NULL; }
+  virtual Cvec3 getColor() = 0;
+  virtual void addInstancedDraw(InstancedDrawList& draws, int first, int count, int lod) {}
 };
 
 
@@ -86,11 +110,28 @@ public:
 };
 
 
+// The scene generation is incremented whenever the structure of the graph or
+// any SgRbtNode changes, so renderings cached from the scene (e.g., the picking
+// buffer) can tell whether they are stale.
+unsigned long getSceneGeneration();
+void bumpSceneGeneration();
+
 RigTForm getPathAccumRbt(
   std::tr1::shared_ptr<SgTransformNode> source,
   std::tr1::shared_ptr<SgTransformNode> destination,
   int offsetFromDestination = 0);
 
+// Same as getPathAccumRbt for many destinations, done in a single traversal:
+// rbts[i] is the accumulated rbt for destinations[i]. If `nested' is not NULL,
+// (*nested)[i] is set to whether another destination is an ancestor of
+// destinations[i].
+void getPathAccumRbts(
+  std::tr1::shared_ptr<SgTransformNode> source,
+  const std::vector<std::tr1::shared_ptr<SgTransformNode> >& destinations,
+  std::vector<RigTForm>& rbts,
+  int offsetFromDestination = 0,
+  std::vector<bool> *nested = NULL);
+
 
 //----------------------------------------------------
 // Concrete scene graph node implementations follow
@@ -118,6 +159,7 @@ public:
 
   void setRbt(const RigTForm& rbt) {
     rbt_ = rbt;
+    bumpSceneGeneration();
   }
 
 private:
@@ -129,6 +171,9 @@ template<typename Geometry>
 class SgGeometryShapeNode : public SgShapeNode {
   std::tr1::shared_ptr<Geometry> geometry_;
   Matrix4 affineMatrix_;
+  Matrix4f affineMatrixf_;
+  Cvec3 scales_;
+  Matrix4f normalMatrixf_;
   Cvec3 color_;
 public:
   SgGeometryShapeNode(std::tr1::shared_ptr<Geometry> geometry,
@@ -142,15 +187,59 @@ public:
                     Matrix4::makeXRotation(eulerAngles[0]) *
                     Matrix4::makeYRotation(eulerAngles[1]) *
                     Matrix4::makeZRotation(eulerAngles[2]) *
-                    Matrix4::makeScale(scales)) {}
+                    Matrix4::makeScale(scales))
+    , affineMatrixf_(affineMatrix_)
+    , scales_(scales) {
+    // The inverse transpose of rotation * scale is rotation * inverse scale
+    const Matrix4 rotation = Matrix4::makeXRotation(eulerAngles[0]) *
+                             Matrix4::makeYRotation(eulerAngles[1]) *
+                             Matrix4::makeZRotation(eulerAngles[2]);
+    normalMatrixf_ = Matrix4f(rotation * Matrix4::makeScale(Cvec3(1/scales[0], 1/scales[1], 1/scales[2])));
+  }
 
   virtual Matrix4 getAffineMatrix() {
     return affineMatrix_;
   }
 
-  virtual void draw(const ShaderState& curSS) {
+  virtual Matrix4f getAffineMatrixf() {
+    return affineMatrixf_;
+  }
+
+  virtual Matrix4f getNormalMatrixf() {
+    return normalMatrixf_;
+  }
+
+  Cvec3 getScales() const {
+    return scales_;
+  }
+
+  virtual int getNumLods() {
+    return geometry_->getNumLods();
+  }
+
+  virtual int selectLod(double radiusPixels) {
+    return geometry_->selectLod(radiusPixels);
+  }
+
+  virtual void draw(const ShaderState& curSS, int lod) {
     safe_glUniform3f(curSS.h_uColor, color_[0], color_[1], color_[2]);
-    geometry_->draw(curSS);
+    geometry_->getLod(lod).draw(curSS);
+  }
+
+  virtual ShapeBound getLocalBound() {
+    return geometry_->bound;
+  }
+
+  virtual const void* getInstanceKey(int lod) {
+    return &geometry_->getLod(lod);
+  }
+
+  virtual Cvec3 getColor() {
+    return color_;
+  }
+
+  virtual void addInstancedDraw(InstancedDrawList& draws, int first, int count, int lod) {
+    geometry_->getLod(lod).addInstancedDraw(draws, first, count);
   }
 };
 
@@ -4,6 +4,7 @@
 #include <vector>
 
 #include "scenegraph.h"
+#include "trace.h"
 
 struct RbtNodesScanner : public SgNodeVisitor {
   typedef std::vector<std::tr1::shared_ptr<SgRbtNode> > SgRbtNodes;
@@ -46,6 +47,7 @@ struct RbtNodesFiller : public SgNodeVisitor {
 };
 
 inline void fillSgRbtNodes(std::tr1::shared_ptr<SgNode> root, std::vector<RigTForm >& rbts) {
+  TRACE_SCOPE("fillSgRbtNodes");
   RbtNodesFiller filler(rbts, 0);
   root->accept(filler);
 }
@@ -0,0 +1,195 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "shadercache.h"
+#include "timing.h"
+
+using namespace std;
+using namespace std::tr1;
+
+static const char CACHE_MAGIC[8] = {'C', 'S', '1', '7', '5', 'P', 'B', '1'};
+
+// 64 bit FNV-1a, continued from `h'
+static unsigned long long hashBytes(unsigned long long h, const char *data, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    h = (h ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// Includes the terminating zero, so that consecutive strings cannot run together
+static unsigned long long hashString(unsigned long long h, const char *s) {
+  return hashBytes(h, s ? s : "", s ? strlen(s) + 1 : 1);
+}
+
+ShaderProgramCache::ShaderProgramCache(const char *directory)
+  : directory_(directory) {
+#ifndef __MAC__
+  binaries_ = GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary;
+#else
+  binaries_ = true;
+#endif
+  if (binaries_) {
+    GLint numFormats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+    binaries_ = numFormats > 0;
+  }
+  if (binaries_)
+    mkdir(directory, 0755); // may already exist; failing to save later is not fatal either
+}
+
+void ShaderProgramCache::add(GLuint program, const char *vsfn, const char *fsfn) {
+  vector<char> vsSource, fsSource;
+  readTextFile(vsfn, vsSource);
+  readTextFile(fsfn, fsSource);
+  add(program, vsfn, fsfn, vsSource, fsSource);
+}
+
+void ShaderProgramCache::add(GLuint program, const string& vsName, const string& fsName,
+                             const vector<char>& vsSource, const vector<char>& fsSource) {
+  entries_.push_back(Entry());
+  Entry& e = entries_.back();
+  e.program = program;
+  e.vsName = vsName;
+  e.fsName = fsName;
+  e.vsSource = vsSource;
+  e.fsSource = fsSource;
+}
+
+bool ShaderProgramCache::load(const Entry& e) {
+  ifstream ifs(e.cacheFile.c_str(), ios::binary);
+  if (!ifs)
+    return false;
+
+  char magic[sizeof(CACHE_MAGIC)];
+  GLenum format;
+  if (!ifs.read(magic, sizeof(magic)) || memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0 ||
+      !ifs.read(reinterpret_cast<char*>(&format), sizeof(format)))
+    return false;
+  const vector<char> binary((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+  if (binary.empty())
+    return false;
+
+  // an unknown format would raise a GL error rather than just fail to link
+  GLint numFormats = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+  vector<GLint> formats(numFormats);
+  glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, &formats[0]);
+  if (find(formats.begin(), formats.end(), GLint(format)) == formats.end())
+    return false;
+
+  glProgramBinary(e.program, format, &binary[0], binary.size());
+  GLint linked = 0;
+  glGetProgramiv(e.program, GL_LINK_STATUS, &linked);
+  return linked != 0;
+}
+
+void ShaderProgramCache::save(const Entry& e) {
+  GLint length = 0;
+  glGetProgramiv(e.program, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0)
+    return;
+
+  vector<char> binary(length);
+  GLsizei written = 0;
+  GLenum format = 0;
+  glGetProgramBinary(e.program, length, &written, &format, &binary[0]);
+
+  // written aside and renamed, so that a concurrent run never sees half a file
+  const string tmp = e.cacheFile + ".tmp";
+  {
+    ofstream ofs(tmp.c_str(), ios::binary);
+    ofs.write(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    ofs.write(reinterpret_cast<const char*>(&format), sizeof(format));
+    ofs.write(&binary[0], written);
+    if (ofs)
+      ofs.close();
+    if (!ofs || rename(tmp.c_str(), e.cacheFile.c_str()) != 0) {
+      cerr << "WARN: cannot write shader cache file " << e.cacheFile << endl;
+      remove(tmp.c_str());
+    }
+  }
+}
+
+void ShaderProgramCache::build() {
+  const char *vendor = reinterpret_cast<const char*>(glGetString(GL_VENDOR));
+  const char *renderer = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+  const char *version = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+
+  vector<Entry*> cold;
+  for (int i = 0; i < entries_.size(); ++i) {
+    Entry& e = entries_[i];
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    h = hashBytes(h, &e.vsSource[0], e.vsSource.size());
+    h = hashString(h, "");
+    h = hashBytes(h, &e.fsSource[0], e.fsSource.size());
+    h = hashString(h, "");
+    h = hashString(h, vendor);
+    h = hashString(h, renderer);
+    h = hashString(h, version);
+    ostringstream name;
+    name << directory_ << "/" << hex << setw(16) << setfill('0') << h << ".bin";
+    e.cacheFile = name.str();
+
+    if (!binaries_)
+      cold.push_back(&e);
+    else {
+      ScopedPhase phase(getStartupTimer(), "load " + e.vsName + " + " + e.fsName);
+      if (!load(e))
+        cold.push_back(&e);
+    }
+  }
+
+#ifndef __MAC__
+  if (!cold.empty() && GLEW_KHR_parallel_shader_compile)
+    glMaxShaderCompilerThreadsKHR(0xFFFFFFFF); // as many as the driver likes
+#endif
+
+  // Submit every compile and link before waiting on any
+  PhaseTimer& timer = getStartupTimer();
+  timer.begin("submit compiles");
+  for (int i = 0; i < cold.size(); ++i) {
+    Entry& e = *cold[i];
+    e.vs.reset(new GlShader(GL_VERTEX_SHADER));
+    e.fs.reset(new GlShader(GL_FRAGMENT_SHADER));
+    const char *vsPtr = &e.vsSource[0], *fsPtr = &e.fsSource[0];
+    const GLint vsLen = e.vsSource.size(), fsLen = e.fsSource.size();
+    glShaderSource(*e.vs, 1, &vsPtr, &vsLen);
+    glShaderSource(*e.fs, 1, &fsPtr, &fsLen);
+    glCompileShader(*e.vs);
+    glCompileShader(*e.fs);
+  }
+  for (int i = 0; i < cold.size(); ++i) {
+    Entry& e = *cold[i];
+    glAttachShader(e.program, *e.vs);
+    glAttachShader(e.program, *e.fs);
+    if (binaries_)
+      glProgramParameteri(e.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(e.program);
+  }
+  timer.end();
+
+  for (int i = 0; i < cold.size(); ++i) {
+    Entry& e = *cold[i];
+    ScopedPhase phase(timer, "compile " + e.vsName + " + " + e.fsName);
+    checkShaderCompiled(*e.vs, e.vsName.c_str());
+    checkShaderCompiled(*e.fs, e.fsName.c_str());
+    glDetachShader(e.program, *e.vs);
+    glDetachShader(e.program, *e.fs);
+    checkProgramLinked(e.program);
+    e.vs.reset();
+    e.fs.reset();
+
+    if (binaries_)
+      save(e);
+  }
+  checkGlErrors();
+  entries_.clear();
+}
@@ -0,0 +1,54 @@
+#ifndef SHADERCACHE_H
+#define SHADERCACHE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#if __GNUG__
+#   include <tr1/memory>
+#endif
+
+#include "glsupport.h"
+
+// Builds a batch of GL programs from vertex/fragment shader pairs.
+//
+// Linked programs are saved with glGetProgramBinary into `directory', one
+// file per program named after a hash of both sources and the GL vendor,
+// renderer and version strings, and later runs load them back with
+// glProgramBinary. A binary the driver rejects is simply recompiled.
+//
+// Programs that have to be compiled are all submitted before any result is
+// queried, so that drivers compiling in the background (more threads with
+// KHR_parallel_shader_compile) work on them at the same time.
+class ShaderProgramCache : Noncopyable {
+public:
+  explicit ShaderProgramCache(const char *directory);
+
+  // Queues `program' to be built by the next build()
+  void add(GLuint program, const char *vsfn, const char *fsfn);
+
+  // Same for sources already in memory; the names are only used in messages
+  void add(GLuint program, const std::string& vsName, const std::string& fsName,
+           const std::vector<char>& vsSource, const std::vector<char>& fsSource);
+
+  // Builds everything queued. Throws runtime_error on error
+  void build();
+
+private:
+  struct Entry {
+    GLuint program;
+    std::string vsName, fsName;
+    std::vector<char> vsSource, fsSource;
+    std::string cacheFile;
+    std::tr1::shared_ptr<GlShader> vs, fs; // only while compiling
+  };
+
+  std::string directory_;
+  std::vector<Entry> entries_;
+  bool binaries_;                          // program binaries are supported
+
+  bool load(const Entry& e);
+  void save(const Entry& e);
+};
+
+#endif
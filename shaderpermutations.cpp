@@ -0,0 +1,90 @@
+#include <cstring>
+#include <algorithm>
+
+#include "shaderpermutations.h"
+#include "shadercache.h"
+
+using namespace std;
+using namespace std::tr1;
+
+static const char * const FEATURE_NAMES[] = {"LIT", "PICK", "PER_DRAW", "INSTANCED"};
+static const int NUM_FEATURES = sizeof(FEATURE_NAMES) / sizeof(FEATURE_NAMES[0]);
+
+// The source with a #define per feature, placed after the #version line since
+// nothing but comments may precede that
+static vector<char> defineFeatures(const vector<char>& source, unsigned features) {
+  string defines;
+  for (int i = 0; i < NUM_FEATURES; ++i) {
+    if (features & (1u << i))
+      defines += string("#define ") + FEATURE_NAMES[i] + " 1\n";
+  }
+
+  vector<char>::const_iterator at = source.begin();
+  static const char VERSION[] = "#version";
+  if (source.size() >= sizeof(VERSION) - 1 && memcmp(&source[0], VERSION, sizeof(VERSION) - 1) == 0) {
+    at = find(source.begin(), source.end(), '\n');
+    if (at != source.end())
+      ++at;
+    else
+      defines = "\n" + defines;
+  }
+
+  vector<char> result(source.begin(), at);
+  result.insert(result.end(), defines.begin(), defines.end());
+  result.insert(result.end(), at, source.end());
+  return result;
+}
+
+// e.g. "[LIT,PER_DRAW]", to tell permutations apart in messages
+static string describeFeatures(unsigned features) {
+  string s = "[";
+  for (int i = 0; i < NUM_FEATURES; ++i) {
+    if (features & (1u << i))
+      s += string(s.size() > 1 ? "," : "") + FEATURE_NAMES[i];
+  }
+  return s + "]";
+}
+
+ShaderPermutations::ShaderPermutations(const char *vsfn, const char *fsfn, const char *cacheDirectory)
+  : vsfn_(vsfn)
+  , fsfn_(fsfn)
+  , cacheDirectory_(cacheDirectory) {
+  readTextFile(vsfn, vsSource_);
+  readTextFile(fsfn, fsSource_);
+}
+
+void ShaderPermutations::prepare(const vector<unsigned>& features) {
+  ShaderProgramCache cache(cacheDirectory_.c_str());
+  vector<unsigned> added;
+  for (int i = 0; i < features.size(); ++i) {
+    if (programs_.count(features[i]))
+      continue;
+    shared_ptr<ShaderState> ss(new ShaderState());
+    const string name = describeFeatures(features[i]);
+    cache.add(ss->program, vsfn_ + name, fsfn_ + name,
+              defineFeatures(vsSource_, features[i]), defineFeatures(fsSource_, features[i]));
+    programs_[features[i]] = ss;
+    added.push_back(features[i]);
+  }
+  if (added.empty())
+    return;
+
+  try {
+    cache.build();
+  }
+  catch (...) {
+    // so that a later get() tries again rather than returning a broken program
+    for (int i = 0; i < added.size(); ++i) {
+      programs_.erase(added[i]);
+    }
+    throw;
+  }
+  for (int i = 0; i < added.size(); ++i) {
+    programs_[added[i]]->retrieveHandles();
+  }
+}
+
+const ShaderState& ShaderPermutations::build(unsigned features) {
+  prepare(vector<unsigned>(1, features));
+  return *programs_[features];
+}
@@ -0,0 +1,56 @@
+#ifndef SHADERPERMUTATIONS_H
+#define SHADERPERMUTATIONS_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <memory>
+#if __GNUG__
+#   include <tr1/memory>
+#endif
+
+#include "glsupport.h"
+#include "asstcommon.h"
+
+// Features a shader permutation is built with. Each one becomes a #define of
+// the same name, without the SHADER_ prefix, in both shader sources.
+enum ShaderFeature {
+  SHADER_LIT = 1,                          // diffuse lighting, otherwise a flat color
+  SHADER_PICK = 2,                         // writes object ids for picking instead of colors
+  SHADER_PER_DRAW = 4,                     // matrices from the PerDraw uniform block (GL3 only)
+  SHADER_INSTANCED = 8                     // matrices and color per instance (GL3 only)
+};
+
+// The programs built from one vertex/fragment shader pair by switching
+// features on and off, so that each draw can use a program that does only
+// what it needs without a source file per combination.
+//
+// A permutation is compiled on its first get() and kept from then on. Those
+// known to be needed early should be passed to prepare(), which compiles them
+// in one batch. Both go through ShaderProgramCache, so later runs load the
+// linked programs instead.
+class ShaderPermutations : Noncopyable {
+public:
+  // Throws runtime_error if a file cannot be read
+  ShaderPermutations(const char *vsfn, const char *fsfn, const char *cacheDirectory);
+
+  // Builds the permutations not built yet. Throws runtime_error on error
+  void prepare(const std::vector<unsigned>& features);
+
+  // The permutation with exactly `features', a combination of ShaderFeature
+  const ShaderState& get(unsigned features) {
+    const std::map<unsigned, std::tr1::shared_ptr<ShaderState> >::const_iterator i = programs_.find(features);
+    if (i != programs_.end())
+      return *i->second;
+    return build(features);
+  }
+
+private:
+  std::string vsfn_, fsfn_, cacheDirectory_;
+  std::vector<char> vsSource_, fsSource_;
+  std::map<unsigned, std::tr1::shared_ptr<ShaderState> > programs_;
+
+  const ShaderState& build(unsigned features);
+};
+
+#endif
@@ -0,0 +1,116 @@
+#include <cstdio>
+#include <iomanip>
+#include <algorithm>
+#ifdef __MAC__
+#   include <mach/mach_time.h>
+#else
+#   include <time.h>
+#endif
+
+#include "timing.h"
+
+using namespace std;
+
+double getMonotonicSeconds() {
+#ifdef __MAC__
+  static mach_timebase_info_data_t timebase;
+  if (timebase.denom == 0)
+    mach_timebase_info(&timebase);
+  return double(mach_absolute_time()) * timebase.numer / timebase.denom * 1e-9;
+#else
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+PhaseTimer::PhaseTimer()
+  : origin_(getMonotonicSeconds())
+  , total_(0)
+  , finished_(false) {}
+
+void PhaseTimer::begin(const string& name) {
+  if (finished_)
+    return;
+  Phase p;
+  p.name = name;
+  p.depth = open_.size();
+  p.start = getMonotonicSeconds() - origin_;
+  p.duration = 0;
+  open_.push_back(phases_.size());
+  phases_.push_back(p);
+}
+
+void PhaseTimer::end() {
+  if (finished_ || open_.empty())
+    return;
+  Phase& p = phases_[open_.back()];
+  p.duration = getMonotonicSeconds() - origin_ - p.start;
+  open_.pop_back();
+}
+
+void PhaseTimer::finish() {
+  while (!open_.empty())
+    end();
+  total_ = getMonotonicSeconds() - origin_;
+  finished_ = true;
+}
+
+void PhaseTimer::printTable(ostream& os) const {
+  const double total = finished_ ? total_ : getMonotonicSeconds() - origin_;
+
+  size_t width = 5;
+  for (int i = 0; i < phases_.size(); ++i) {
+    width = max(width, 2 * phases_[i].depth + phases_[i].name.size());
+  }
+
+  const ios::fmtflags flags = os.flags();
+  os << left << setw(width) << "phase" << right << setw(12) << "ms" << setw(8) << "%" << "\n"
+     << fixed << setprecision(2);
+  for (int i = 0; i < phases_.size(); ++i) {
+    const Phase& p = phases_[i];
+    os << string(2 * p.depth, ' ') << left << setw(width - 2 * p.depth) << p.name << right
+       << setw(12) << p.duration * 1000 << setw(8) << (total > 0 ? p.duration / total * 100 : 0) << "\n";
+  }
+  os << left << setw(width) << "total" << right << setw(12) << total * 1000 << setw(8) << 100.0 << endl;
+  os.flags(flags);
+}
+
+// Quotes a string for JSON
+static string jsonString(const string& s) {
+  string r = "\"";
+  for (int i = 0; i < s.size(); ++i) {
+    const unsigned char c = s[i];
+    if (c == '"' || c == '\\') {
+      r += '\\';
+      r += c;
+    }
+    else if (c < 0x20) {
+      char buf[8];
+      sprintf(buf, "\\u%04x", c);
+      r += buf;
+    }
+    else
+      r += c;
+  }
+  return r + "\"";
+}
+
+void PhaseTimer::writeJson(ostream& os) const {
+  const double total = finished_ ? total_ : getMonotonicSeconds() - origin_;
+
+  const ios::fmtflags flags = os.flags();
+  os << fixed << setprecision(3) << "{\"total_ms\": " << total * 1000 << ", \"phases\": [";
+  for (int i = 0; i < phases_.size(); ++i) {
+    const Phase& p = phases_[i];
+    os << (i ? ",\n  " : "\n  ") << "{\"name\": " << jsonString(p.name) << ", \"depth\": " << p.depth
+       << ", \"start_ms\": " << p.start * 1000 << ", \"duration_ms\": " << p.duration * 1000 << "}";
+  }
+  os << "\n]}" << endl;
+  os.flags(flags);
+}
+
+PhaseTimer& getStartupTimer() {
+  static PhaseTimer timer;
+  return timer;
+}
@@ -0,0 +1,64 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "glsupport.h"
+
+// Seconds on a monotonic clock, from an arbitrary origin
+double getMonotonicSeconds();
+
+// Records how long the steps of a one-off process such as startup take.
+// Phases nest: one begun while another is still open is its sub-step. Once
+// finish() is called further phases are ignored, so code that also runs
+// later (e.g. creating a Geometry) can record phases unconditionally.
+class PhaseTimer : Noncopyable {
+public:
+  PhaseTimer();
+
+  void begin(const std::string& name);
+  void end();
+
+  // Closes the open phases and stops recording
+  void finish();
+
+  // An indented table of the phases with milliseconds and share of the total
+  void printTable(std::ostream& os) const;
+
+  // The same as a JSON object
+  void writeJson(std::ostream& os) const;
+
+private:
+  struct Phase {
+    std::string name;
+    int depth;
+    double start, duration;           // seconds since origin_
+  };
+
+  double origin_, total_;
+  bool finished_;
+  std::vector<Phase> phases_;
+  std::vector<int> open_;             // indices into phases_, innermost last
+};
+
+// Times the enclosing scope as a phase of `timer'
+class ScopedPhase : Noncopyable {
+  PhaseTimer& timer_;
+
+public:
+  ScopedPhase(PhaseTimer& timer, const std::string& name)
+    : timer_(timer) {
+    timer_.begin(name);
+  }
+
+  ~ScopedPhase() {
+    timer_.end();
+  }
+};
+
+// The phases from the start of main to the first frame on screen
+PhaseTimer& getStartupTimer();
+
+#endif
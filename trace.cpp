@@ -0,0 +1,113 @@
+#ifdef CS175_TRACE
+
+#include <cstdio>
+#include <vector>
+#include <stdexcept>
+#include <pthread.h>
+
+#include "trace.h"
+#include "timing.h"
+
+using namespace std;
+
+namespace {
+struct TraceEvent {
+  const char *name;
+  double start, duration;
+  int tid;
+};
+
+struct TraceBuffer {
+  vector<TraceEvent> events;               // a ring once full
+  unsigned long count;                     // ever recorded
+  int tid;                                 // of the thread currently owning it
+  bool retired;                            // its thread exited
+};
+}
+
+static pthread_once_t g_traceOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_traceKey;
+static pthread_mutex_t g_traceMutex = PTHREAD_MUTEX_INITIALIZER;
+static vector<TraceBuffer*> g_traceBuffers; // never freed, so events outlive their threads
+static int g_traceNextTid = 1;
+
+static void retireTraceBuffer(void *buffer) {
+  pthread_mutex_lock(&g_traceMutex);
+  static_cast<TraceBuffer*>(buffer)->retired = true;
+  pthread_mutex_unlock(&g_traceMutex);
+}
+
+static void initTrace() {
+  pthread_key_create(&g_traceKey, retireTraceBuffer);
+}
+
+static TraceBuffer *getTraceBuffer() {
+  TraceBuffer *b = static_cast<TraceBuffer*>(pthread_getspecific(g_traceKey));
+  if (b)
+    return b;
+
+  pthread_mutex_lock(&g_traceMutex);
+  for (int i = 0; i < g_traceBuffers.size() && !b; ++i) {
+    if (g_traceBuffers[i]->retired)
+      b = g_traceBuffers[i];
+  }
+  if (!b) {
+    b = new TraceBuffer();
+    b->events.resize(TRACE_BUFFER_EVENTS);
+    b->count = 0;
+    g_traceBuffers.push_back(b);
+  }
+  b->retired = false;
+  b->tid = g_traceNextTid++;
+  pthread_mutex_unlock(&g_traceMutex);
+
+  pthread_setspecific(g_traceKey, b);
+  return b;
+}
+
+void traceEvent(const char *name, double start, double end) {
+  pthread_once(&g_traceOnce, initTrace);
+  TraceBuffer *b = getTraceBuffer();
+  TraceEvent& e = b->events[b->count % TRACE_BUFFER_EVENTS];
+  e.name = name;
+  e.start = start;
+  e.duration = end - start;
+  e.tid = b->tid;
+  ++b->count;
+}
+
+TraceScope::TraceScope(const char *name)
+  : name_(name)
+  , start_(getMonotonicSeconds()) {}
+
+TraceScope::~TraceScope() {
+  traceEvent(name_, start_, getMonotonicSeconds());
+}
+
+void writeChromeTrace(const char *filename) {
+  pthread_once(&g_traceOnce, initTrace);
+
+  FILE *f = fopen(filename, "w");
+  if (!f)
+    throw runtime_error(string("Cannot open file ") + filename + " for write");
+
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  bool first = true;
+  pthread_mutex_lock(&g_traceMutex);
+  for (int i = 0; i < g_traceBuffers.size(); ++i) {
+    const TraceBuffer& b = *g_traceBuffers[i];
+    const unsigned long begin = b.count > TRACE_BUFFER_EVENTS ? b.count - TRACE_BUFFER_EVENTS : 0;
+    for (unsigned long j = begin; j < b.count; ++j) {
+      const TraceEvent& e = b.events[j % TRACE_BUFFER_EVENTS];
+      // names are identifiers, so need no escaping
+      fprintf(f, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+              first ? "" : ",", e.name, e.tid, e.start * 1e6, e.duration * 1e6);
+      first = false;
+    }
+  }
+  pthread_mutex_unlock(&g_traceMutex);
+  fprintf(f, "\n]}\n");
+  fclose(f);
+}
+
+#endif
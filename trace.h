@@ -0,0 +1,48 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Scoped trace events, exported in the Chrome trace event format (load the
+// file in chrome://tracing or ui.perfetto.dev).
+//
+// TRACE_SCOPE("name") records the time from where it appears to the end of
+// the enclosing scope. Tracing is compiled in only when CS175_TRACE is
+// defined (make TRACE=1); otherwise TRACE_SCOPE expands to nothing.
+//
+// Each thread records into its own ring buffer of the latest
+// TRACE_BUFFER_EVENTS events, so recording takes no lock. The buffer of a
+// thread that exits is kept, and reused by the next thread to start tracing.
+
+#ifdef CS175_TRACE
+
+#include "glsupport.h"
+
+static const int TRACE_BUFFER_EVENTS = 1 << 16;
+
+// Records an event of the calling thread, with times in seconds on the
+// getMonotonicSeconds clock. `name' must outlive the trace, e.g. a string literal
+void traceEvent(const char *name, double start, double end);
+
+// Writes the events recorded so far by all threads. Threads still tracing
+// while this runs may have their latest events torn
+void writeChromeTrace(const char *filename);
+
+class TraceScope : Noncopyable {
+  const char *name_;
+  double start_;
+
+public:
+  explicit TraceScope(const char *name);
+  ~TraceScope();
+};
+
+#define CS175_TRACE_CONCAT2(a, b) a##b
+#define CS175_TRACE_CONCAT(a, b) CS175_TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) TraceScope CS175_TRACE_CONCAT(traceScope_, __LINE__)(name)
+
+#else
+
+#define TRACE_SCOPE(name) ((void)0)
+
+#endif
+
+#endif